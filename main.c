@@ -3,11 +3,59 @@
 * Copyright (c) 2025 Patrick Seute
 */
 
+#if !defined(_WIN32)
+#define _DEFAULT_SOURCE
+#endif
+
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <ctype.h>
+#include <limits.h>
+#include <stdlib.h>
 #include <math.h>
 #include <string.h>
+#include <time.h>
+
+#if !defined(_WIN32)
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define ASCIIGEN_THREADS
+#if defined(__linux__)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+// IORING_OP_READ arrived along with this feature flag, in Linux 5.6
+#if defined(__NR_io_uring_setup) && defined(IORING_FEAT_RW_CUR_POS)
+#define ASCIIGEN_URING
+#endif
+#endif
+#else
+#include <windows.h>
+#endif
+
+// x86-64 builds carry kernels for several instruction set levels and pick one at startup
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#define ASCIIGEN_CPU_DISPATCH
+#endif
+
+// Decode and resize buffers come from the per-render arena, see arena_malloc
+void* arena_malloc(const size_t size);
+void* arena_realloc(void *p, const size_t size);
+void arena_free(void *p);
+#define STBI_MALLOC(size) arena_malloc(size)
+#define STBI_REALLOC(p, size) arena_realloc(p, size)
+void* inflate_realloc(void *p, const size_t old_size, const size_t size);
+#define STBI_REALLOC_SIZED(p, old_size, size) inflate_realloc(p, old_size, size)
+#define STBI_FREE(p) arena_free(p)
+#define STBIR_MALLOC(size, user_data) ((void)(user_data), arena_malloc(size))
+#define STBIR_FREE(ptr, user_data) ((void)(user_data), arena_free(ptr))
 
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
@@ -15,6 +63,9 @@
 #include "stb_image_resize2.h"
 
 #define VERSION "1.6"
+#define CHAR_ASPECT 2.0
+#define MAX_VARIANTS 16
+#define MAX_STYLES 16
 
 
 typedef struct image_data {
@@ -22,257 +73,5958 @@ typedef struct image_data {
     int height;
     int width;
     int channel_count;
+    // Bytes from one row to the next, or 0 when rows are packed
+    size_t stride;
 } image_data;
 
-double get_pixel_brightness(const image_data *image, const int x, const int y) {
-    const size_t pixel_index = (y * image->width + x) * image->channel_count;
+// An image as the mapping stage reads it: output cell x,y is the pixel at
+// data + x * x_step + y * y_step. Rotations and flips only change the steps, so an
+// oriented image is never copied. lum, when not NULL, already holds the brightness of
+// every cell as a byte, row by row, as read from a version 1 --save-lum file. brightness,
+// when not NULL, holds it exactly as the kernels compute it, computed once for several
+// styles or read from a --save-lum file.
+typedef struct image_view {
+    const unsigned char *data;
+    ptrdiff_t x_step;
+    ptrdiff_t y_step;
+    int height;
+    int width;
+    int channel_count;
+    const unsigned char *lum;
+    const double *brightness;
+} image_view;
+
+// Orientations are a transpose followed by flips of the output axes, as bits
+#define ORIENT_FLIP_X 1
+#define ORIENT_FLIP_Y 2
+#define ORIENT_TRANSPOSE 4
 
-    const uint8_t red = (uint8_t)image->data[pixel_index];
-    const uint8_t green = (uint8_t)image->data[pixel_index+1];
-    const uint8_t blue = (uint8_t)image->data[pixel_index+2];
-    const uint8_t alpha = image->channel_count >= 4 ? (uint8_t)image->data[pixel_index+3] : 255;
+// A file to render, with its contents when they have been read ahead of time. data is
+// NULL when the file is read from disk as it's needed.
+typedef struct input_file {
+    const char *name;
+    unsigned char *data;
+    size_t size;
+} input_file;
 
-    const double pr = 0.299;
-    const double pg = 0.587;
-    const double pb = 0.114;
+typedef struct decode_info {
+    const char *method;
+    size_t compressed_used;
+    size_t compressed_total;
+} decode_info;
 
-    const double brightness = sqrt((pr * red * red) + (pg * green * green) + (pb * blue * blue));
-    return brightness * (alpha / 255.0);
+const unsigned char* view_pixel(const image_view *view, const int x, const int y) {
+    return view->data + x * view->x_step + y * view->y_step;
 }
 
-void resize_image(image_data *img, const int new_width, const int new_height) {
-    unsigned char *resized_data = malloc(new_width*new_height*img->channel_count);
-    if(!resized_data) {
-        fputs("Failed to allocate memory for resized image\n", stderr);
-        exit(1);
+// Views img as it looks after applying orientation. Cell 0,0 starts at whichever corner
+// of the stored image the orientation moves to the top left.
+image_view orient_view(const image_data *img, const int orientation) {
+    const ptrdiff_t pixel = img->channel_count;
+    const ptrdiff_t row = img->stride ? (ptrdiff_t)img->stride : (ptrdiff_t)img->width * pixel;
+    const bool transpose = orientation & ORIENT_TRANSPOSE;
+    // The stored axes the output's x and y walk along
+    ptrdiff_t x_step = transpose ? row : pixel;
+    ptrdiff_t y_step = transpose ? pixel : row;
+    const int x_count = transpose ? img->height : img->width;
+    const int y_count = transpose ? img->width : img->height;
+    const unsigned char *origin = img->data;
+    if(orientation & ORIENT_FLIP_X) {
+        origin += (x_count - 1) * x_step;
+        x_step = -x_step;
+    }
+    if(orientation & ORIENT_FLIP_Y) {
+        origin += (y_count - 1) * y_step;
+        y_step = -y_step;
     }
+    image_view view = {origin, x_step, y_step, y_count, x_count, img->channel_count, NULL, NULL};
+    return view;
+}
+
+// The orientation that applies inner and then outer. A transpose in outer swaps which
+// axes inner's flips land on.
+int combine_orientation(const int inner, const int outer) {
+    const int inner_x = outer & ORIENT_TRANSPOSE ? (inner & ORIENT_FLIP_Y) != 0 : (inner & ORIENT_FLIP_X) != 0;
+    const int inner_y = outer & ORIENT_TRANSPOSE ? (inner & ORIENT_FLIP_X) != 0 : (inner & ORIENT_FLIP_Y) != 0;
+    return ((inner ^ outer) & ORIENT_TRANSPOSE) | ((outer & (ORIENT_FLIP_X | ORIENT_FLIP_Y)) ^ (inner_x ? ORIENT_FLIP_X : 0) ^ (inner_y ? ORIENT_FLIP_Y : 0));
+}
 
-    stbir_resize(
-        img->data, img->width, img->height, 0, 
-        resized_data, new_width, new_height, 0, img->channel_count, 
-        STBIR_TYPE_UINT8, STBIR_EDGE_CLAMP, STBIR_FILTER_POINT_SAMPLE
-    );
+// Kernels for each CPU level. A cell's brightness is
+// sqrt(0.299 r^2 + 0.587 g^2 + 0.114 b^2) scaled by its alpha, and every level computes
+// the same bits, so forcing a level with --cpu-level only changes the speed.
+typedef enum cpu_level {
+    CPU_BASELINE,
+    CPU_AVX2,
+    CPU_AVX512,
+    CPU_LEVEL_COUNT
+} cpu_level;
 
-    if(!resized_data) {
-        fputs("Failed to resize image...\n", stderr);
-        exit(1);
+#if defined(ASCIIGEN_CPU_DISPATCH)
+static const char *const cpu_level_names[CPU_LEVEL_COUNT] = {"sse2", "avx2", "avx512"};
+#else
+static const char *const cpu_level_names[CPU_LEVEL_COUNT] = {"generic", "avx2", "avx512"};
+#endif
+
+// Cells go through the kernels a block at a time, so each step runs over whole vectors
+#define KERNEL_BLOCK 64
+
+// Brightness of count cells of row y from x on, with 0 for the rest of the block
+typedef void (*brightness_fn)(const image_view *img, const int x, const int y, const int count, double *out);
+
+typedef struct cpu_kernels {
+    cpu_level level;
+    // One per channel count, 1 to 4
+    brightness_fn brightness[4];
+    // (int)((value + offset) * scale) of every value of a block
+    void (*quantize)(const double *values, const double offset, const double scale, int *out);
+    int (*resize)(STBIR_RESIZE *resize);
+    const char *resize_name;
+} cpu_kernels;
+
+#if defined(__GNUC__)
+#define KERNEL_INLINE static inline __attribute__((always_inline))
+#else
+#define KERNEL_INLINE static inline
+#endif
+
+// AVX-512 implies FMA, and a fused multiply-add rounds differently from the SSE2 code
+#if defined(ASCIIGEN_CPU_DISPATCH) && defined(__clang__)
+#pragma STDC FP_CONTRACT OFF
+#define CPU_TARGET(isa) __attribute__((target(isa)))
+#elif defined(ASCIIGEN_CPU_DISPATCH)
+#define CPU_TARGET(isa) __attribute__((target(isa), optimize("fp-contract=off")))
+#else
+#define CPU_TARGET(isa)
+#endif
+
+// The weighted sum of the squared channels of count cells, and their alpha as a fraction,
+// for a block padded with black. channels is a constant in every caller, so each channel
+// count compiles to its own loop. Gray images weigh their one value as all three colors,
+// and a second channel is alpha.
+KERNEL_INLINE void weigh_cells(const image_view *img, const int x, const int y, const int count, const int channels,
+                               double *squares, double *coverage) {
+    double red[KERNEL_BLOCK];
+    double green[KERNEL_BLOCK];
+    double blue[KERNEL_BLOCK];
+    double alpha[KERNEL_BLOCK];
+    const unsigned char *pixel = view_pixel(img, x, y);
+    const ptrdiff_t step = img->x_step;
+    for(int i = 0; i < count; i++, pixel += step) {
+        red[i] = pixel[0];
+        green[i] = channels >= 3 ? pixel[1] : pixel[0];
+        blue[i] = channels >= 3 ? pixel[2] : pixel[0];
+        alpha[i] = channels == 2 || channels == 4 ? pixel[channels - 1] : 255;
+    }
+    for(int i = count; i < KERNEL_BLOCK; i++) {
+        red[i] = 0;
+        green[i] = 0;
+        blue[i] = 0;
+        alpha[i] = 255;
+    }
+    for(int i = 0; i < KERNEL_BLOCK; i++) {
+        squares[i] = (0.299 * red[i] * red[i]) + (0.587 * green[i] * green[i]) + (0.114 * blue[i] * blue[i]);
+        coverage[i] = alpha[i] / 255.0;
     }
-    stbi_image_free(img->data);
-    img->data = resized_data;
-    img->width = new_width;
-    img->height = new_height;
 }
 
-void scale_image(image_data *img, const double w_scale, const double h_scale) {
-    const int new_width = (int)(img->width * w_scale);
-    const int new_height = (int)(img->height * h_scale);
-    resize_image(img, new_width, new_height);
+KERNEL_INLINE void quantize_block(const double *values, const double offset, const double scale, int *out) {
+    for(int i = 0; i < KERNEL_BLOCK; i++) {
+        out[i] = (int)((values[i] + offset) * scale);
+    }
 }
 
-char* image_to_string(const image_data *img, bool invert, char *characters) {
-    const size_t chars_length = strlen(characters);
-    const size_t char_count = (img->width * img->height) + img->height + 1;
-    char *result_str = malloc(char_count);
-    size_t result_itr = 0;
-    if(result_str == NULL) {
-        return NULL;
+// sqrt(squares) * coverage of a block. The compiler won't vectorize sqrt while it may
+// have to set errno, so the square roots are spelled out at each level's vector width.
+#if defined(ASCIIGEN_CPU_DISPATCH)
+KERNEL_INLINE CPU_TARGET("sse2") void root_block_sse2(const double *squares, const double *coverage, double *out) {
+    for(int i = 0; i < KERNEL_BLOCK; i += 2) {
+        _mm_storeu_pd(out + i, _mm_mul_pd(_mm_sqrt_pd(_mm_loadu_pd(squares + i)), _mm_loadu_pd(coverage + i)));
     }
-    for(int y = 0; y < img->height; y++) {
-        for(int x = 0; x < img->width; x++) {
-            const double brightness = get_pixel_brightness(img, x, y);
-            const size_t char_index = (int)(brightness / (255.1 / chars_length));
-            result_str[result_itr] = invert ? characters[chars_length - 1 - char_index] : characters[char_index];
-            result_itr++;
+}
+
+KERNEL_INLINE CPU_TARGET("avx2") void root_block_avx2(const double *squares, const double *coverage, double *out) {
+    for(int i = 0; i < KERNEL_BLOCK; i += 4) {
+        _mm256_storeu_pd(out + i, _mm256_mul_pd(_mm256_sqrt_pd(_mm256_loadu_pd(squares + i)), _mm256_loadu_pd(coverage + i)));
+    }
+}
+
+KERNEL_INLINE CPU_TARGET("avx512f") void root_block_avx512(const double *squares, const double *coverage, double *out) {
+    for(int i = 0; i < KERNEL_BLOCK; i += 8) {
+        _mm512_storeu_pd(out + i, _mm512_mul_pd(_mm512_sqrt_pd(_mm512_loadu_pd(squares + i)), _mm512_loadu_pd(coverage + i)));
+    }
+}
+#else
+KERNEL_INLINE void root_block_generic(const double *squares, const double *coverage, double *out) {
+    for(int i = 0; i < KERNEL_BLOCK; i++) {
+        out[i] = sqrt(squares[i]) * coverage[i];
+    }
+}
+#endif
+
+// Stamps out a level's kernels: brightness_<level>_<channels> for each channel count, and
+// quantize_<level>.
+#define BRIGHTNESS_KERNEL(level, isa, channels) \
+    CPU_TARGET(isa) void brightness_##level##_##channels(const image_view *img, const int x, const int y, const int count, double *out) { \
+        double squares[KERNEL_BLOCK]; \
+        double coverage[KERNEL_BLOCK]; \
+        weigh_cells(img, x, y, count, channels, squares, coverage); \
+        root_block_##level(squares, coverage, out); \
+    }
+
+#define LEVEL_KERNELS(level, isa) \
+    BRIGHTNESS_KERNEL(level, isa, 1) \
+    BRIGHTNESS_KERNEL(level, isa, 2) \
+    BRIGHTNESS_KERNEL(level, isa, 3) \
+    BRIGHTNESS_KERNEL(level, isa, 4) \
+    CPU_TARGET(isa) void quantize_##level(const double *values, const double offset, const double scale, int *out) { \
+        quantize_block(values, offset, scale, out); \
+    }
+
+#define LEVEL_BRIGHTNESS(level) {brightness_##level##_1, brightness_##level##_2, brightness_##level##_3, brightness_##level##_4}
+
+#if defined(ASCIIGEN_CPU_DISPATCH)
+LEVEL_KERNELS(sse2, "sse2")
+LEVEL_KERNELS(avx2, "avx2")
+LEVEL_KERNELS(avx512, "avx512f")
+
+#if defined(ASCIIGEN_RESIZE_AVX2)
+// stb_image_resize2 built with its AVX2 paths in resize_avx2.c. It has no AVX-512 paths.
+int resize_extended_avx2(STBIR_RESIZE *resize);
+#define RESIZE_AVX2 resize_extended_avx2, "avx2"
+#else
+#define RESIZE_AVX2 stbir_resize_extended, "sse2"
+#endif
+
+static const cpu_kernels kernel_levels[CPU_LEVEL_COUNT] = {
+    {CPU_BASELINE, LEVEL_BRIGHTNESS(sse2), quantize_sse2, stbir_resize_extended, "sse2"},
+    {CPU_AVX2, LEVEL_BRIGHTNESS(avx2), quantize_avx2, RESIZE_AVX2},
+    {CPU_AVX512, LEVEL_BRIGHTNESS(avx512), quantize_avx512, RESIZE_AVX2},
+};
+#else
+LEVEL_KERNELS(generic, "")
+
+// Only the baseline is ever selected here
+static const cpu_kernels kernel_levels[CPU_LEVEL_COUNT] = {
+    {CPU_BASELINE, LEVEL_BRIGHTNESS(generic), quantize_generic, stbir_resize_extended, "generic"},
+    {CPU_AVX2, LEVEL_BRIGHTNESS(generic), quantize_generic, stbir_resize_extended, "generic"},
+    {CPU_AVX512, LEVEL_BRIGHTNESS(generic), quantize_generic, stbir_resize_extended, "generic"},
+};
+#endif
+
+// The kernels in use, set once by select_kernels before any work starts
+const cpu_kernels *kernels = &kernel_levels[CPU_BASELINE];
+
+// The highest level the running CPU and OS support
+cpu_level detect_cpu_level(void) {
+#if defined(ASCIIGEN_CPU_DISPATCH)
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx512f")) {
+        return CPU_AVX512;
+    }
+    if(__builtin_cpu_supports("avx2")) {
+        return CPU_AVX2;
+    }
+#endif
+    return CPU_BASELINE;
+}
+
+void select_kernels(const cpu_level level) {
+    kernels = &kernel_levels[level];
+}
+
+brightness_fn brightness_kernel(const image_view *img) {
+    return kernels->brightness[img->channel_count - 1];
+}
+
+// Brightness of count cells of row y from x on, as kernel computes it or as img already
+// holds it, with 0 for the rest of the block
+void cell_brightness(const image_view *img, const brightness_fn kernel, const int x, const int y, const int count, double *out) {
+    if(!img->brightness) {
+        kernel(img, x, y, count, out);
+        return;
+    }
+    memcpy(out, img->brightness + (size_t)y * img->width + x, sizeof(double) * count);
+    for(int i = count; i < KERNEL_BLOCK; i++) {
+        out[i] = 0;
+    }
+}
+
+// Brightness of every cell of row y, rounded to a byte
+void brightness_bytes(const image_view *img, const int y, unsigned char *out) {
+    const brightness_fn brightness = brightness_kernel(img);
+    double values[KERNEL_BLOCK];
+    int rounded[KERNEL_BLOCK];
+    for(int x = 0; x < img->width; x += KERNEL_BLOCK) {
+        const int count = img->width - x < KERNEL_BLOCK ? img->width - x : KERNEL_BLOCK;
+        cell_brightness(img, brightness, x, y, count, values);
+        kernels->quantize(values, 0.5, 1.0, rounded);
+        for(int i = 0; i < count; i++) {
+            out[x + i] = (unsigned char)rounded[i];
         }
-        result_str[result_itr] = '\n';
-        result_itr++;
     }
-    result_str[result_itr] = '\0';
-    return result_str;
 }
 
-void open_image(image_data *img, const char *filename) {
-    int width, height, channel_count;
-    unsigned char *data = stbi_load(filename, &width, &height, &channel_count, 0);
-    if(!data) {
-        const char *reason = stbi_failure_reason();
-        fprintf(stderr, "Error loading image: %s", reason);
-        if(strcmp(reason, "can't fopen") == 0) {
-            fprintf(stderr, " - the file %s may not exist.", filename);
+// Picks a character of a set for each brightness as (int)(brightness / (255.1 / length))
+// would, without dividing. The quantize kernel multiplies by the rounded reciprocal, which
+// can land one off next to a boundary, and map_ramp moves it to the right side of the
+// exact thresholds. glyphs already has -i applied.
+typedef struct char_ramp {
+    char *glyphs;
+    double *thresholds;
+    double scale;
+} char_ramp;
+
+void ramp_init(char_ramp *ramp, const char *characters, const bool invert) {
+    const size_t length = strlen(characters);
+    const double step = 255.1 / length;
+    ramp->glyphs = malloc(length);
+    ramp->thresholds = malloc(sizeof(double) * (length + 1));
+    if(!ramp->glyphs || !ramp->thresholds) {
+        fputs("Failed to allocate memory for the character ramp\n", stderr);
+        exit(1);
+    }
+    ramp->scale = 1.0 / step;
+    // thresholds[k] is the least brightness the division maps to k or above
+    ramp->thresholds[0] = -INFINITY;
+    ramp->thresholds[length] = INFINITY;
+    for(size_t k = 0; k < length; k++) {
+        ramp->glyphs[k] = invert ? characters[length - 1 - k] : characters[k];
+        if(k == 0) {
+            continue;
         }
-        fputs("\n", stderr);
+        double t = k * step;
+        while((size_t)(t / step) >= k) {
+            t = nextafter(t, -INFINITY);
+        }
+        while((size_t)(t / step) < k) {
+            t = nextafter(t, INFINITY);
+        }
+        ramp->thresholds[k] = t;
+    }
+}
+
+void ramp_free(char_ramp *ramp) {
+    free(ramp->glyphs);
+    free(ramp->thresholds);
+}
+
+void map_ramp(const char_ramp *ramp, const double *brightness, const int *index, const int count, char *out) {
+    for(int i = 0; i < count; i++) {
+        int k = index[i];
+        k += brightness[i] >= ramp->thresholds[k + 1];
+        k -= brightness[i] < ramp->thresholds[k];
+        out[i] = ramp->glyphs[k];
+    }
+}
+
+// Resizes src into dest, whose data, width and height are already set.
+void resize_pixels(const image_data *src, image_data *dest) {
+    STBIR_RESIZE resize;
+    stbir_resize_init(&resize, src->data, src->width, src->height, (int)src->stride, dest->data, dest->width, dest->height, 0,
+                      (stbir_pixel_layout)src->channel_count, STBIR_TYPE_UINT8);
+    resize.horizontal_edge = STBIR_EDGE_CLAMP;
+    resize.vertical_edge = STBIR_EDGE_CLAMP;
+    resize.horizontal_filter = STBIR_FILTER_POINT_SAMPLE;
+    resize.vertical_filter = STBIR_FILTER_POINT_SAMPLE;
+    // stb_image_resize2 refuses an empty output, which a tiny enough scale gives
+    if(dest->width > 0 && dest->height > 0 && !kernels->resize(&resize)) {
+        fputs("Failed to resize image...\n", stderr);
         exit(1);
     }
-    img->data = data;
-    img->width = width;
-    img->height = height;
-    img->channel_count = channel_count;
+    dest->channel_count = src->channel_count;
+    dest->stride = 0;
+}
+
+// Resizes src into a newly allocated dest, leaving src untouched.
+void resize_into(const image_data *src, image_data *dest, const int new_width, const int new_height) {
+    unsigned char *resized_data = arena_malloc((size_t)new_width*new_height*src->channel_count);
+    if(!resized_data) {
+        fputs("Failed to allocate memory for resized image\n", stderr);
+        exit(1);
+    }
+    dest->data = resized_data;
+    dest->width = new_width;
+    dest->height = new_height;
+    resize_pixels(src, dest);
+}
+
+void resize_image(image_data *img, const int new_width, const int new_height) {
+    image_data resized;
+    resize_into(img, &resized, new_width, new_height);
+    stbi_image_free(img->data);
+    *img = resized;
+}
+
+void scale_image(image_data *img, const double w_scale, const double h_scale) {
+    const int new_width = (int)(img->width * w_scale);
+    const int new_height = (int)(img->height * h_scale);
+    resize_image(img, new_width, new_height);
 }
 
+typedef enum dither_mode {
+    DITHER_NONE,
+    DITHER_FLOYD,
+    DITHER_ATKINSON,
+    DITHER_BAYER4,
+    DITHER_BAYER8
+} dither_mode;
+
+typedef enum tone_mode {
+    TONE_NONE,
+    TONE_AUTO_CONTRAST,
+    TONE_EQUALIZE
+} tone_mode;
+
+typedef struct crop_rect {
+    int x;
+    int y;
+    int width;
+    int height;
+} crop_rect;
+
+typedef enum output_format {
+    FORMAT_TEXT,
+    FORMAT_HTML,
+    FORMAT_SVG
+} output_format;
+
 typedef struct config {
-    char *filename;
+    char **filenames;
+    int file_count;
     char *character_set;
     bool invert;
+    char *character_sets[MAX_STYLES];
+    int character_set_count;
+    char *style_sets[MAX_STYLES];
+    bool style_inverts[MAX_STYLES];
+    int style_count;
     double w_scaling;
     double h_scaling;
     double scaling;
+    double w_scales[MAX_VARIANTS];
+    double h_scales[MAX_VARIANTS];
+    int variant_count;
+    dither_mode dither;
+    int threads;
+    bool stats;
+    bool fit;
+    int columns;
+    int rows;
+    bool plan;
+    char *output_path;
+    output_format format;
+    crop_rect crop;
+    bool prefer_thumbnail;
+    int orientation;
+    bool exif_orientation;
+    int prefetch;
+    int shard;
+    int shard_count;
+    char *manifest_path;
+    int montage_columns;
+    int montage_rows;
+    bool captions;
+    bool edges;
+    tone_mode tone;
+    char *save_lum_path;
+    bool from_lum;
+    cpu_level cpu_level;
+    bool huge_pages;
+    // --stream frame size, a width of 0 when images are read from files
+    int stream_width;
+    int stream_height;
+    int stream_channels;
+    double max_latency;
+    bool cache_frames;
+    int frame_tolerance;
 } config;
 
-char* str_dup(const char *s) {
-    if(s == NULL) {
+double now_ms(void) {
+#if !defined(_WIN32)
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+#else
+    return clock() * 1000.0 / CLOCKS_PER_SEC;
+#endif
+}
+
+#ifndef STBI_THREAD_LOCAL
+#define STBI_THREAD_LOCAL
+#endif
+
+typedef struct arena arena;
+// The arena of the render the calling thread works on, or NULL outside of one
+static STBI_THREAD_LOCAL arena *current_arena;
+
+typedef void (*worker_fn)(void *ctx, int worker, int worker_count);
+
+typedef struct worker_args {
+    worker_fn fn;
+    void *ctx;
+    arena *render;
+    int worker;
+    int worker_count;
+} worker_args;
+
+#if defined(ASCIIGEN_THREADS)
+void* worker_entry(void *arg) {
+    const worker_args *args = arg;
+    // Workers allocate from the arena of the render that started them
+    current_arena = args->render;
+    args->fn(args->ctx, args->worker, args->worker_count);
+    return NULL;
+}
+#endif
+
+// Runs fn once per worker and waits for all of them, the calling thread acting as worker 0.
+// Builds without pthreads always run a single worker.
+void run_workers(int worker_count, worker_fn fn, void *ctx) {
+#if defined(ASCIIGEN_THREADS)
+    if(worker_count > 1) {
+        pthread_t *threads = malloc(sizeof(pthread_t) * worker_count);
+        worker_args *args = malloc(sizeof(worker_args) * worker_count);
+        if(!threads || !args) {
+            fputs("Failed to allocate memory for worker threads\n", stderr);
+            exit(1);
+        }
+        for(int i = 1; i < worker_count; i++) {
+            args[i].fn = fn;
+            args[i].ctx = ctx;
+            args[i].render = current_arena;
+            args[i].worker = i;
+            args[i].worker_count = worker_count;
+            if(pthread_create(&threads[i], NULL, worker_entry, &args[i]) != 0) {
+                fputs("Failed to start worker thread\n", stderr);
+                exit(1);
+            }
+        }
+        fn(ctx, 0, worker_count);
+        for(int i = 1; i < worker_count; i++) {
+            pthread_join(threads[i], NULL);
+        }
+        free(args);
+        free(threads);
+        return;
+    }
+#endif
+    fn(ctx, 0, 1);
+}
+
+// The per-render arena. Each image's decode, resize and output buffers, and the memory
+// stb_image and stb_image_resize2 use internally, are bump allocated from a chunk that is
+// rewound rather than freed between images, so a batch touches the same pages again
+// instead of going back to malloc and the kernel for every image. The chunk is sized from
+// the image's header before it is decoded. A render that outgrows it carries on in more
+// chunks, which are merged into one chunk of their total size before the next render.
+#define ARENA_ALIGN 64
+#define ARENA_NONE SIZE_MAX
+// Chunks are whole huge pages, so --huge-pages can back all of one
+#define ARENA_GRANULE ((size_t)2 << 20)
+
+typedef struct arena_chunk {
+    struct arena_chunk *older;
+    unsigned char *base;
+    size_t capacity;
+    size_t top;
+    // Offset of the newest allocation still live, which can be freed or grown in place
+    size_t last;
+    // The mmap the chunk was carved from, or NULL when it came from malloc
+    void *mapping;
+    size_t mapping_size;
+} arena_chunk;
+
+struct arena {
+    // Newest first. Allocations only ever come from the newest
+    arena_chunk *chunks;
+    bool huge_pages;
+#if defined(ASCIIGEN_THREADS)
+    pthread_mutex_t lock;
+#endif
+    size_t used;
+    size_t peak;
+    // Highest peak of any earlier render in the current chunk, below which its pages are
+    // already backed
+    size_t touched;
+    // How much of the last render's peak an earlier render had already touched
+    size_t reused;
+    size_t allocations;
+};
+
+// Sits in the ARENA_ALIGN bytes before every allocation, so freeing it doesn't depend on
+// which thread frees it. owner is NULL for memory allocated outside any render, which
+// comes straight from malloc.
+typedef struct arena_header {
+    arena *owner;
+    arena_chunk *chunk;
+    size_t size;
+    size_t previous;
+} arena_header;
+
+#if defined(ASCIIGEN_THREADS)
+#define arena_lock(a) pthread_mutex_lock(&(a)->lock)
+#define arena_unlock(a) pthread_mutex_unlock(&(a)->lock)
+#else
+#define arena_lock(a) ((void)(a))
+#define arena_unlock(a) ((void)(a))
+#endif
+
+// Maps a chunk of at least capacity bytes, or takes it from malloc where mmap isn't
+// available or fails. With huge_pages the kernel is asked to back it with transparent huge
+// pages where it supports them.
+arena_chunk* arena_chunk_open(const size_t capacity, const bool huge_pages) {
+    if(capacity > SIZE_MAX / 2 - ARENA_GRANULE) {
         return NULL;
     }
-    size_t size = strlen(s) + 1;
-    char *new_str = malloc(size);
-    if(new_str == NULL) {
+    arena_chunk *chunk = calloc(1, sizeof(arena_chunk));
+    if(!chunk) {
         return NULL;
     }
-    strncpy(new_str, s, size);
-    return new_str;
+    chunk->capacity = (capacity + ARENA_GRANULE - 1) & ~(ARENA_GRANULE - 1);
+    chunk->last = ARENA_NONE;
+#if !defined(_WIN32)
+    // Mapped one huge page over so the chunk can start on a huge page boundary
+    const size_t mapping_size = chunk->capacity + (huge_pages ? ARENA_GRANULE : 0);
+    void *mapping = mmap(NULL, mapping_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(mapping != MAP_FAILED) {
+        chunk->mapping = mapping;
+        chunk->mapping_size = mapping_size;
+        chunk->base = mapping;
+#if defined(MADV_HUGEPAGE)
+        if(huge_pages) {
+            chunk->base = (unsigned char*)(((uintptr_t)mapping + ARENA_GRANULE - 1) & ~(uintptr_t)(ARENA_GRANULE - 1));
+            madvise(chunk->base, chunk->capacity, MADV_HUGEPAGE);
+        }
+#endif
+    }
+#else
+    (void)huge_pages;
+#endif
+    if(!chunk->base) {
+        chunk->base = malloc(chunk->capacity);
+    }
+    if(!chunk->base) {
+        free(chunk);
+        return NULL;
+    }
+    return chunk;
 }
 
-void default_config(config *conf) {
-    conf->filename = str_dup("");
-    conf->character_set = str_dup("@%#*+=-:. ");
-    conf->invert = false;
-    conf->h_scaling = -1.0;
-    conf->w_scaling = -1.0;
-    conf->scaling = 1.0;
+void arena_chunk_close(arena_chunk *chunk) {
+#if !defined(_WIN32)
+    if(chunk->mapping) {
+        munmap(chunk->mapping, chunk->mapping_size);
+        free(chunk);
+        return;
+    }
+#endif
+    free(chunk->base);
+    free(chunk);
 }
 
-void print_version(void) {
-    printf("asciigen - v%s\n", VERSION);
+void arena_release(arena *a) {
+    while(a->chunks) {
+        arena_chunk *older = a->chunks->older;
+        arena_chunk_close(a->chunks);
+        a->chunks = older;
+    }
+    a->touched = 0;
 }
 
-void print_help(void) {
-    puts("Usage:\n       asciigen [options] image.png");
-    puts("Options:");
-    puts("  -i              inverts light and dark colors. Brightest pixels use densest characters");
-    puts("  -w scale        Width scaling factor. Output's width will be original_width * scale");
-    puts("  -h scale        Height scaling factor. Output's height will be original_height * scale");
-    puts("  -s scale        Even scaling factor. Output's dimensions will be original * scale");
-    puts("  -c \"chars\"      Custom character set chars will be used rather than the default of \"@%#*+=-:. \"");
-    puts("  -v, --version   Prints version");
-    puts("  -H, --help      Prints help");
+// Chunks are only made once a render says how much it needs, see arena_begin
+void arena_open(arena *a, const bool huge_pages) {
+    memset(a, 0, sizeof(*a));
+    a->huge_pages = huge_pages;
+#if defined(ASCIIGEN_THREADS)
+    pthread_mutex_init(&a->lock, NULL);
+#endif
 }
 
-void set_config(config *conf, int argc, char **argv) {
-    default_config(conf);
-    bool get_filename = true;
-    int scaling_token_index = -1;
-    int h_scaling_token_index = -1;
-    int w_scaling_token_index = -1;
-    int custom_characters_index = -1;
-    for(int i = 1; i < argc; i++) {
-        char *token = argv[i];
-        int index_mod = 1;
-        if(strcmp(token, "--help") == 0) {
-            get_filename = false;
-            print_help();
-            exit(0);
-        }
-        else if(strcmp(token, "--version") == 0) {
-            get_filename = false;
-            print_version();
-            exit(0);
-        }
-        else if(token[0] == '-') {
-            for(size_t j = 1; j < strlen(token); j++) {
-                char currOpt = token[j];
-                switch(currOpt) {
-                    case 'i':
-                        conf->invert = true;
-                        break;
-                    case 's':
-                        scaling_token_index = i+index_mod;
-                        index_mod++;
-                        break;
-                    case 'w':
-                        w_scaling_token_index = i+index_mod;
-                        index_mod++;
-                        break;
-                    case 'h':
-                        h_scaling_token_index = i+index_mod;
-                        index_mod++;
-                        break;
-                    case 'c':
-                        custom_characters_index = i+index_mod;
-                        index_mod++;
-                        break;
-                    case 'H':
-                        get_filename = false;
-                        print_help();
-                        exit(0);
-                        break;
-                    case 'v':
-                    case 'V':
-                        get_filename = false;
-                        print_version();
-                        exit(0);
-                        break;
-                }
-            }
-        }
-        else if(i == scaling_token_index && i != argc-1) {
-            conf->scaling = strtod(argv[i], NULL);
-        }
-        else if(i == w_scaling_token_index && i != argc-1) {
-            conf->w_scaling = strtod(argv[i], NULL);
-        }
-        else if(i == h_scaling_token_index && i != argc-1) {
-            conf->h_scaling = strtod(argv[i], NULL);
-        }
-        else if(i == custom_characters_index && i != argc-1) {
-            if(conf->character_set != NULL) {
-                free(conf->character_set);
-            }
-            conf->character_set = str_dup(argv[i]);
+void arena_close(arena *a) {
+    arena_release(a);
+#if defined(ASCIIGEN_THREADS)
+    pthread_mutex_destroy(&a->lock);
+#endif
+}
+
+// A first guess at what rendering a width x height image takes from its arena: the
+// decoded pixels, and twice that again for stb_image's working buffers, such as a PNG's
+// inflated rows or a 16-bit image before it is narrowed to 8 bits.
+size_t arena_hint(const int width, const int height, const int channels) {
+    return width > 0 && height > 0 && channels > 0 ? (size_t)width * height * channels * 3 : 0;
+}
+
+// Starts a render in a on the calling thread, and on the workers it starts. Everything
+// from the last render is given back, and a chunk too small for hint bytes, or the several
+// a render outgrew its chunk into, is replaced by one large enough for both.
+void arena_begin(arena *a, const size_t hint) {
+    size_t total = 0;
+    for(const arena_chunk *chunk = a->chunks; chunk; chunk = chunk->older) {
+        total += chunk->capacity;
+    }
+    if(a->chunks && (a->chunks->older || a->chunks->capacity < hint)) {
+        arena_release(a);
+    }
+    if(!a->chunks) {
+        // When this fails, arena_malloc tries again for each allocation
+        a->chunks = arena_chunk_open(total > hint ? total : hint, a->huge_pages);
+    }
+    if(a->chunks) {
+        a->chunks->top = 0;
+        a->chunks->last = ARENA_NONE;
+    }
+    a->used = 0;
+    a->peak = 0;
+    a->allocations = 0;
+    current_arena = a;
+}
+
+void arena_end(arena *a) {
+    current_arena = NULL;
+    a->reused = a->peak < a->touched ? a->peak : a->touched;
+    a->touched = a->peak > a->touched ? a->peak : a->touched;
+}
+
+void* arena_malloc(const size_t size) {
+    arena *a = current_arena;
+    if(size > SIZE_MAX / 2) {
+        return NULL;
+    }
+    if(!a) {
+        arena_header *header = malloc(ARENA_ALIGN + size);
+        if(!header) {
+            return NULL;
         }
+        header->owner = NULL;
+        header->size = size;
+        return (unsigned char*)header + ARENA_ALIGN;
     }
-    if(get_filename) {
-        free(conf->filename);
-        conf->filename = str_dup(argv[argc-1]);
-        if(!conf->filename) {
-            fputs("Error allocating memory for filename...\n", stderr);
-            exit(1);
+    const size_t rounded = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    arena_lock(a);
+    arena_chunk *chunk = a->chunks;
+    if(!chunk || chunk->top + ARENA_ALIGN + rounded > chunk->capacity) {
+        // Outgrown: carry on in a chunk at least as large as the last one
+        const size_t capacity = chunk && chunk->capacity > ARENA_ALIGN + rounded ? chunk->capacity : ARENA_ALIGN + rounded;
+        chunk = arena_chunk_open(capacity, a->huge_pages);
+        if(!chunk) {
+            arena_unlock(a);
+            return NULL;
         }
+        chunk->older = a->chunks;
+        a->chunks = chunk;
     }
-    const bool width_valid = conf->w_scaling > 0.0;
-    const bool height_valid = conf->h_scaling > 0.0;
-    const bool even_scaling = !width_valid && !height_valid;
-    if(!even_scaling && (!width_valid || !height_valid)) {
-        fputs("Invalid scaling parameters.\nIf not using equivalent scaling for height and width (-s) both height and width must be supplied and greater than 0.\n", stderr);
-        exit(1);
+    const size_t offset = chunk->top;
+    arena_header *header = (arena_header*)(chunk->base + offset);
+    header->owner = a;
+    header->chunk = chunk;
+    header->size = size;
+    header->previous = chunk->last;
+    chunk->last = offset;
+    chunk->top = offset + ARENA_ALIGN + rounded;
+    a->used += ARENA_ALIGN + rounded;
+    a->peak = a->used > a->peak ? a->used : a->peak;
+    a->allocations++;
+    arena_unlock(a);
+    return chunk->base + offset + ARENA_ALIGN;
+}
+
+void arena_free(void *p) {
+    if(!p) {
+        return;
     }
-    if(even_scaling) {
-        conf->w_scaling = conf->scaling;
-        conf->h_scaling = conf->scaling;
+    arena_header *header = (arena_header*)((unsigned char*)p - ARENA_ALIGN);
+    arena *a = header->owner;
+    if(!a) {
+        free(header);
+        return;
+    }
+    arena_lock(a);
+    arena_chunk *chunk = header->chunk;
+    const size_t offset = (size_t)((unsigned char*)header - chunk->base);
+    if(offset == chunk->last) {
+        // The newest allocation gives its space straight back
+        chunk->last = header->previous;
+        a->used -= chunk->top - offset;
+        chunk->top = offset;
     }
+    arena_unlock(a);
+}
 
+void* arena_realloc(void *p, const size_t size) {
+    if(!p) {
+        return arena_malloc(size);
+    }
+    arena_header *header = (arena_header*)((unsigned char*)p - ARENA_ALIGN);
+    arena *a = header->owner;
+    if(!a) {
+        arena_header *grown = size <= SIZE_MAX / 2 ? realloc(header, ARENA_ALIGN + size) : NULL;
+        if(!grown) {
+            return NULL;
+        }
+        grown->size = size;
+        return (unsigned char*)grown + ARENA_ALIGN;
+    }
+    const size_t rounded = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    arena_lock(a);
+    arena_chunk *chunk = header->chunk;
+    const size_t offset = (size_t)((unsigned char*)header - chunk->base);
+    if(offset == chunk->last && size <= SIZE_MAX / 2 && offset + ARENA_ALIGN + rounded <= chunk->capacity) {
+        // The newest allocation grows in place, as zlib's output buffer does
+        const size_t top = offset + ARENA_ALIGN + rounded;
+        a->used = a->used - chunk->top + top;
+        a->peak = a->used > a->peak ? a->used : a->peak;
+        chunk->top = top;
+        header->size = size;
+        arena_unlock(a);
+        return p;
+    }
+    const size_t old_size = header->size;
+    arena_unlock(a);
+    void *moved = arena_malloc(size);
+    if(moved) {
+        memcpy(moved, p, old_size < size ? old_size : size);
+        arena_free(p);
+    }
+    return moved;
 }
 
-int main(int argc, char **argv) {
-    if(argc < 2) {
-        print_help();
-        return 0;
+// For --stats, how much the render just finished drew from the arena
+void arena_report(const arena *a) {
+    int chunks = 0;
+    for(const arena_chunk *chunk = a->chunks; chunk; chunk = chunk->older) {
+        chunks++;
     }
+    fprintf(stderr, "arena:  %9.3f MB peak, %.3f MB reused from earlier images, %zu allocations", a->peak / 1048576.0,
+            a->reused / 1048576.0, a->allocations);
+    if(chunks > 1) {
+        fprintf(stderr, ", outgrew its first chunk into %d", chunks);
+    }
+    fputs("\n", stderr);
+}
 
-    config conf;
-    set_config(&conf, argc, argv);
-    
+void* arena_calloc(const size_t count, const size_t size) {
+    if(size > 0 && count > SIZE_MAX / size) {
+        return NULL;
+    }
+    void *p = arena_malloc(count * size);
+    if(p) {
+        memset(p, 0, count * size);
+    }
+    return p;
+}
+
+// Brightness in 1/16 steps, so error diffusion can stay in integer arithmetic
+#define LUM_MAX (255 * 16)
+#define WAVEFRONT_CHUNK 32
+
+typedef struct diffusion_kernel {
+    int right1;
+    int right2;
+    int below_back;
+    int below;
+    int below_fwd;
+    int below2;
+    int shift;
+} diffusion_kernel;
+
+static const diffusion_kernel floyd_kernel = {7, 0, 3, 5, 1, 0, 4};
+static const diffusion_kernel atkinson_kernel = {1, 1, 1, 1, 1, 1, 3};
+
+typedef struct dither_job {
+    const int *lum;
+    int width;
+    int height;
+    const char *glyphs;
+    const int *level_values;
+    int levels;
+    const diffusion_kernel *kernel;
+    int *err;
+    char *out;
+    size_t pitch;
+} dither_job;
+
+int quantize_level(const int value, const int levels) {
+    if(levels < 2) {
+        return 0;
+    }
+    const int level = (value * (levels - 1) + LUM_MAX / 2) / LUM_MAX;
+    return level < 0 ? 0 : (level >= levels ? levels - 1 : level);
+}
+
+// Diffuses one span of row y, from x_begin up to x_end.
+// Error meant for the rest of the row is carried in carry[] instead of err_row, so
+// a row never writes cells that the next row may be reading in the wavefront variant.
+void diffuse_span(const dither_job *job, const int y, const int x_begin, const int x_end, const int *err_row,
+                  int *below, int *below2, int carry[2]) {
+    const diffusion_kernel *k = job->kernel;
+    const int *lum_row = job->lum + (size_t)y * job->width;
+    char *out_row = job->out + (size_t)y * job->pitch;
+    const int denominator = 1 << k->shift;
+    for(int x = x_begin; x < x_end; x++) {
+        const int value = lum_row[x] + (err_row[x] + carry[0]) / denominator;
+        const int level = quantize_level(value, job->levels);
+        const int error = value - job->level_values[level];
+        out_row[x] = job->glyphs[level];
+        carry[0] = carry[1] + k->right1 * error;
+        carry[1] = k->right2 * error;
+        below[x - 1] += k->below_back * error;
+        below[x] += k->below * error;
+        below[x + 1] += k->below_fwd * error;
+        below2[x] += k->below2 * error;
+    }
+}
+
+// Serial error diffusion over three rotating error rows. Every row is scanned left to right,
+// as the wavefront has to, so both give the same characters at any thread count.
+void diffuse_rows(const dither_job *job) {
+    const int stride = job->width + 4;
+    int *rows = calloc((size_t)stride * 3, sizeof(int));
+    if(!rows) {
+        fputs("Failed to allocate memory for dithering\n", stderr);
+        exit(1);
+    }
+    for(int y = 0; y < job->height; y++) {
+        int *cur = rows + (y % 3) * stride + 2;
+        int *below = rows + ((y + 1) % 3) * stride + 2;
+        int *below2 = rows + ((y + 2) % 3) * stride + 2;
+        int carry[2] = {0, 0};
+        diffuse_span(job, y, 0, job->width, cur, below, below2, carry);
+        memset(cur - 2, 0, sizeof(int) * stride);
+    }
+    free(rows);
+}
+
+#if defined(ASCIIGEN_THREADS)
+// A dither job shared by the wavefront workers, with how far each row has got
+typedef struct wavefront {
+    dither_job *job;
+    int *progress;
+    pthread_mutex_t lock;
+    pthread_cond_t advanced;
+} wavefront;
+
+// Rows are dealt round-robin to workers. Row y may process a chunk once row y-1 has
+// finished one column past it, which covers every tap of both kernels. Each row only adds
+// into the error rows below it, and integer sums don't depend on their order, so this
+// matches diffuse_rows exactly.
+void diffuse_wavefront_worker(void *ctx, int worker, int worker_count) {
+    wavefront *front = ctx;
+    const dither_job *job = front->job;
+    const int stride = job->width + 4;
+    for(int y = worker; y < job->height; y += worker_count) {
+        const int *cur = job->err + (size_t)y * stride + 2;
+        int *below = job->err + (size_t)(y + 1) * stride + 2;
+        int *below2 = job->err + (size_t)(y + 2) * stride + 2;
+        int carry[2] = {0, 0};
+        for(int x = 0; x < job->width; x += WAVEFRONT_CHUNK) {
+            const int x_end = x + WAVEFRONT_CHUNK < job->width ? x + WAVEFRONT_CHUNK : job->width;
+            if(y > 0) {
+                const int needed = x_end + 1 < job->width ? x_end + 1 : job->width;
+                pthread_mutex_lock(&front->lock);
+                while(front->progress[y - 1] < needed) {
+                    pthread_cond_wait(&front->advanced, &front->lock);
+                }
+                pthread_mutex_unlock(&front->lock);
+            }
+            diffuse_span(job, y, x, x_end, cur, below, below2, carry);
+            pthread_mutex_lock(&front->lock);
+            front->progress[y] = x_end;
+            pthread_cond_broadcast(&front->advanced);
+            pthread_mutex_unlock(&front->lock);
+        }
+    }
+}
+
+void diffuse_wavefront(dither_job *job, const int threads) {
+    const int stride = job->width + 4;
+    wavefront front;
+    front.job = job;
+    job->err = calloc((size_t)stride * (job->height + 2), sizeof(int));
+    front.progress = calloc(job->height, sizeof(int));
+    if(!job->err || !front.progress) {
+        fputs("Failed to allocate memory for dithering\n", stderr);
+        exit(1);
+    }
+    pthread_mutex_init(&front.lock, NULL);
+    pthread_cond_init(&front.advanced, NULL);
+    run_workers(threads < job->height ? threads : job->height, diffuse_wavefront_worker, &front);
+    pthread_cond_destroy(&front.advanced);
+    pthread_mutex_destroy(&front.lock);
+    free(front.progress);
+    free(job->err);
+}
+#endif
+
+// Ordered dithering adds a Bayer threshold to each cell before quantizing. The inner
+// loop is branch-free integer math so the compiler can vectorize it.
+void dither_ordered(const dither_job *job, const int order) {
+    static const int quadrant_offsets[4] = {0, 2, 3, 1};
+    int matrix[64] = {0};
+    for(int size = 1; size < order; size *= 2) {
+        int next[64];
+        for(int y = 0; y < size * 2; y++) {
+            for(int x = 0; x < size * 2; x++) {
+                const int base = matrix[(y % size) * size + (x % size)] * 4;
+                next[y * size * 2 + x] = base + quadrant_offsets[(y / size) * 2 + (x / size)];
+            }
+        }
+        memcpy(matrix, next, sizeof(int) * size * size * 4);
+    }
+
+    const int max_level = job->levels - 1;
+    const int mask = order - 1;
+    const int step = max_level > 0 ? LUM_MAX / max_level : 0;
+    int offsets[64];
+    for(int i = 0; i < order * order; i++) {
+        offsets[i] = ((2 * matrix[i] + 1) * step) / (2 * order * order) - step / 2;
+    }
+    const int scale = (max_level * 65536 + LUM_MAX / 2) / LUM_MAX;
+
+    int *level_row = malloc(sizeof(int) * job->width);
+    if(!level_row) {
+        fputs("Failed to allocate memory for dithering\n", stderr);
+        exit(1);
+    }
+    for(int y = 0; y < job->height; y++) {
+        const int *lum_row = job->lum + (size_t)y * job->width;
+        const int *row_offsets = offsets + (y & mask) * order;
+        char *out_row = job->out + (size_t)y * job->pitch;
+        for(int x = 0; x < job->width; x++) {
+            int value = lum_row[x] + row_offsets[x & mask];
+            value = value < 0 ? 0 : value;
+            int level = (value * scale + 32768) >> 16;
+            level = level > max_level ? max_level : level;
+            level_row[x] = level;
+        }
+        for(int x = 0; x < job->width; x++) {
+            out_row[x] = job->glyphs[level_row[x]];
+        }
+    }
+    free(level_row);
+}
+
+// Writes a row of img->width characters every pitch bytes of out. toned, when given, holds
+// the brightness of every cell after tone mapping and is used instead of the pixels.
+void dither_image(const image_view *img, const config *conf, const unsigned char *toned, char *out, const size_t pitch) {
+    const int levels = (int)strlen(conf->character_set);
+    const size_t cell_count = (size_t)img->width * img->height;
+    int *lum = arena_malloc(sizeof(int) * cell_count);
+    char *glyphs = arena_malloc(levels);
+    int *level_values = arena_malloc(sizeof(int) * levels);
+    if(!lum || !glyphs || !level_values) {
+        fputs("Failed to allocate memory for dithering\n", stderr);
+        exit(1);
+    }
+    // (b + 1/32) * 16 rounds exactly as b * 16 + 0.5 does, as scaling by 16 is exact
+    const brightness_fn kernel = brightness_kernel(img);
+    double brightness[KERNEL_BLOCK];
+    for(int y = 0; y < img->height; y++) {
+        int *lum_row = lum + (size_t)y * img->width;
+        for(int x = 0; x < img->width && toned; x++) {
+            lum_row[x] = toned[(size_t)y * img->width + x] * 16;
+        }
+        for(int x = 0; x < img->width && !toned; x += KERNEL_BLOCK) {
+            const int count = img->width - x < KERNEL_BLOCK ? img->width - x : KERNEL_BLOCK;
+            int rounded[KERNEL_BLOCK];
+            cell_brightness(img, kernel, x, y, count, brightness);
+            kernels->quantize(brightness, 0.5 / 16.0, 16.0, rounded);
+            memcpy(lum_row + x, rounded, sizeof(int) * count);
+        }
+    }
+    for(int i = 0; i < levels; i++) {
+        glyphs[i] = conf->invert ? conf->character_set[levels - 1 - i] : conf->character_set[i];
+        level_values[i] = levels > 1 ? (i * LUM_MAX) / (levels - 1) : 0;
+    }
+
+    dither_job job = {lum, img->width, img->height, glyphs, level_values, levels, NULL, NULL, out, pitch};
+    switch(conf->dither) {
+        case DITHER_BAYER4:
+            dither_ordered(&job, 4);
+            break;
+        case DITHER_BAYER8:
+            dither_ordered(&job, 8);
+            break;
+        case DITHER_FLOYD:
+        case DITHER_ATKINSON:
+            job.kernel = conf->dither == DITHER_FLOYD ? &floyd_kernel : &atkinson_kernel;
+#if defined(ASCIIGEN_THREADS)
+            if(conf->threads > 1 && img->height > 1) {
+                diffuse_wavefront(&job, conf->threads);
+                break;
+            }
+#endif
+            diffuse_rows(&job);
+            break;
+        case DITHER_NONE:
+            break;
+    }
+    arena_free(level_values);
+    arena_free(glyphs);
+    arena_free(lum);
+}
+
+// toned holds the brightness of every cell as a byte when tone mapping, and glyph_table
+// the character for each of its values. Otherwise characters maps the brightness of the
+// pixels. ramp is false when the cells already hold dithered characters that edges are
+// drawn over.
+typedef struct render_job {
+    const image_view *img;
+    const config *conf;
+    char *dest;
+    size_t pitch;
+    bool ramp;
+    const unsigned char *toned;
+    const char *glyph_table;
+    const char_ramp *characters;
+} render_job;
+
+void map_rows(const render_job *job, const int y_begin, const int y_end) {
+    const image_view *img = job->img;
+    const brightness_fn kernel = brightness_kernel(img);
+    double brightness[KERNEL_BLOCK];
+    int char_index[KERNEL_BLOCK];
+    for(int y = y_begin; y < y_end; y++) {
+        char *result_str = job->dest + (size_t)y * job->pitch;
+        if(job->toned) {
+            const unsigned char *lum_row = job->toned + (size_t)y * img->width;
+            for(int x = 0; x < img->width; x++) {
+                result_str[x] = job->glyph_table[lum_row[x]];
+            }
+            continue;
+        }
+        for(int x = 0; x < img->width; x += KERNEL_BLOCK) {
+            const int count = img->width - x < KERNEL_BLOCK ? img->width - x : KERNEL_BLOCK;
+            cell_brightness(img, kernel, x, y, count, brightness);
+            kernels->quantize(brightness, 0.0, job->characters->scale, char_index);
+            map_ramp(job->characters, brightness, char_index, count, result_str + x);
+        }
+    }
+}
+
+void map_rows_worker(void *ctx, int worker, int worker_count) {
+    const render_job *job = ctx;
+    const int height = job->img->height;
+    map_rows(job, (int)((long long)height * worker / worker_count), (int)((long long)height * (worker + 1) / worker_count));
+}
+
+// Cells whose Sobel gradient, as |gx| + |gy| over brightness 0-255, reaches this are
+// drawn as edges. A hard black to white step gives 1020.
+#define EDGE_THRESHOLD 256
+// Cells of a row classified at a time. Rows are padded to whole blocks, so the loop has
+// a fixed trip count and vectorizes at -O2.
+#define EDGE_BLOCK 256
+
+// Glyphs by edge code: none, vertical, horizontal with the dense side above or below,
+// rising and falling
+static const char edge_glyphs[6] = {0, '|', '_', '-', '/', '\\'};
+
+// Computes the brightness of row y into lum, padded with a copy of the edge cell on each
+// side, and when out_row is given writes the row's characters from the ramp as map_rows does.
+void brightness_row(const render_job *job, const int y, int *lum, char *out_row) {
+    const image_view *img = job->img;
+    const brightness_fn kernel = brightness_kernel(img);
+    const unsigned char *toned_row = job->toned ? job->toned + (size_t)y * img->width : NULL;
+    double brightness[KERNEL_BLOCK];
+    int rounded[KERNEL_BLOCK];
+    int char_index[KERNEL_BLOCK];
+    for(int x = 0; x < img->width; x += KERNEL_BLOCK) {
+        const int count = img->width - x < KERNEL_BLOCK ? img->width - x : KERNEL_BLOCK;
+        if(toned_row) {
+            for(int i = 0; i < KERNEL_BLOCK; i++) {
+                brightness[i] = i < count ? toned_row[x + i] : 0;
+            }
+        }
+        else {
+            cell_brightness(img, kernel, x, y, count, brightness);
+        }
+        kernels->quantize(brightness, 0.5, 1.0, rounded);
+        memcpy(lum + 1 + x, rounded, sizeof(int) * count);
+        if(out_row) {
+            kernels->quantize(brightness, 0.0, job->characters->scale, char_index);
+            map_ramp(job->characters, brightness, char_index, count, out_row + x);
+        }
+    }
+    lum[0] = lum[1];
+    lum[img->width + 1] = lum[img->width];
+}
+
+// Classifies a block of cells of the middle of three padded brightness rows by their
+// Sobel gradient. The edge runs across the gradient, so a mostly horizontal gradient is a
+// vertical edge. Angles are split at 22.5 degrees (tan = 53/128) without any division,
+// and the loop is branch-free integer math so the compiler can vectorize it.
+void edge_codes(const int *restrict above, const int *restrict row, const int *restrict below, const int dense_sign,
+                unsigned char *restrict codes) {
+    for(int x = 0; x < EDGE_BLOCK; x++) {
+        const int gx = (above[x + 2] - above[x]) + 2 * (row[x + 2] - row[x]) + (below[x + 2] - below[x]);
+        const int gy = (below[x] - above[x]) + 2 * (below[x + 1] - above[x + 1]) + (below[x + 2] - above[x + 2]);
+        const int ax = gx < 0 ? -gx : gx;
+        const int ay = gy < 0 ? -gy : gy;
+        const int horizontal = gy * dense_sign > 0 ? 2 : 3;
+        const int diagonal = (gx ^ gy) >= 0 ? 4 : 5;
+        const int code = ay * 128 <= ax * 53 ? 1 : (ax * 128 <= ay * 53 ? horizontal : diagonal);
+        codes[x] = (unsigned char)(ax + ay >= EDGE_THRESHOLD ? code : 0);
+    }
+}
+
+// Draws the edges of rows y_begin to y_end over the brightness ramp, or over what is
+// already in dest when job->ramp is false. Brightness is kept for a rolling window of
+// three rows, each computed once, so the stencil never reads outside a few KB.
+void edge_rows(const render_job *job, const int y_begin, const int y_end) {
+    const int width = job->img->width;
+    const int height = job->img->height;
+    const size_t padded = ((size_t)width + EDGE_BLOCK - 1) / EDGE_BLOCK * EDGE_BLOCK + 2;
+    int *window = calloc(padded * 3, sizeof(int));
+    unsigned char codes[EDGE_BLOCK];
+    if(!window) {
+        fputs("Failed to allocate memory for edge detection\n", stderr);
+        exit(1);
+    }
+    // Brightness falls as density rises unless inverted, so gy > 0 means dense above
+    const int dense_sign = job->conf->invert ? -1 : 1;
+    int *rows[3] = {window, window + padded, window + padded * 2};
+    brightness_row(job, y_begin > 0 ? y_begin - 1 : 0, rows[0], NULL);
+    brightness_row(job, y_begin, rows[1], job->ramp ? job->dest + (size_t)y_begin * job->pitch : NULL);
+    for(int y = y_begin; y < y_end; y++) {
+        const int next = y + 1 < height ? y + 1 : y;
+        brightness_row(job, next, rows[2], job->ramp && y + 1 < y_end ? job->dest + (size_t)next * job->pitch : NULL);
+        char *out_row = job->dest + (size_t)y * job->pitch;
+        for(int x_begin = 0; x_begin < width; x_begin += EDGE_BLOCK) {
+            const int count = width - x_begin < EDGE_BLOCK ? width - x_begin : EDGE_BLOCK;
+            edge_codes(rows[0] + x_begin, rows[1] + x_begin, rows[2] + x_begin, dense_sign, codes);
+            for(int x = 0; x < count; x++) {
+                if(codes[x]) {
+                    out_row[x_begin + x] = edge_glyphs[codes[x]];
+                }
+            }
+        }
+        int *oldest = rows[0];
+        rows[0] = rows[1];
+        rows[1] = rows[2];
+        rows[2] = oldest;
+    }
+    free(window);
+}
+
+void edge_rows_worker(void *ctx, int worker, int worker_count) {
+    const render_job *job = ctx;
+    const int height = job->img->height;
+    edge_rows(job, (int)((long long)height * worker / worker_count), (int)((long long)height * (worker + 1) / worker_count));
+}
+
+size_t rendered_size(const image_view *img) {
+    return (size_t)(img->width + 1) * img->height;
+}
+
+// Brightness of every cell as a byte, with one histogram of the values per worker so
+// workers never share a counter, or none when histograms is NULL.
+typedef struct lum_job {
+    const image_view *img;
+    unsigned char *lum;
+    uint32_t *histograms;
+} lum_job;
+
+void lum_rows_worker(void *ctx, int worker, int worker_count) {
+    const lum_job *job = ctx;
+    const image_view *img = job->img;
+    uint32_t *histogram = job->histograms ? job->histograms + (size_t)worker * 256 : NULL;
+    const int y_begin = (int)((long long)img->height * worker / worker_count);
+    const int y_end = (int)((long long)img->height * (worker + 1) / worker_count);
+    for(int y = y_begin; y < y_end; y++) {
+        unsigned char *lum_row = job->lum + (size_t)y * img->width;
+        if(img->lum) {
+            memcpy(lum_row, img->lum + (size_t)y * img->width, img->width);
+        }
+        else {
+            brightness_bytes(img, y, lum_row);
+        }
+        for(int x = 0; x < img->width && histogram; x++) {
+            histogram[lum_row[x]]++;
+        }
+    }
+}
+
+int lum_workers(const image_view *img, const int threads) {
+    const int workers = threads < img->height ? threads : img->height;
+    return workers > 1 ? workers : 1;
+}
+
+// Computes the brightness byte of every cell of img into lum, split across the workers.
+void compute_lum(const image_view *img, const int workers, unsigned char *lum, uint32_t *histograms) {
+    lum_job job = {img, lum, histograms};
+    run_workers(workers, lum_rows_worker, &job);
+}
+
+// The exact brightness of every cell, computed a block at a time by the kernels
+typedef struct brightness_job {
+    const image_view *img;
+    double *brightness;
+} brightness_job;
+
+void brightness_rows_worker(void *ctx, int worker, int worker_count) {
+    const brightness_job *job = ctx;
+    const image_view *img = job->img;
+    const brightness_fn kernel = brightness_kernel(img);
+    double block[KERNEL_BLOCK];
+    const int y_begin = (int)((long long)img->height * worker / worker_count);
+    const int y_end = (int)((long long)img->height * (worker + 1) / worker_count);
+    for(int y = y_begin; y < y_end; y++) {
+        double *row = job->brightness + (size_t)y * img->width;
+        for(int x = 0; x < img->width; x += KERNEL_BLOCK) {
+            const int count = img->width - x < KERNEL_BLOCK ? img->width - x : KERNEL_BLOCK;
+            kernel(img, x, y, count, block);
+            memcpy(row + x, block, sizeof(double) * count);
+        }
+    }
+}
+
+// Computes the brightness of every cell of img into brightness, split across the workers.
+void compute_brightness(const image_view *img, const int workers, double *brightness) {
+    brightness_job job = {img, brightness};
+    run_workers(workers, brightness_rows_worker, &job);
+}
+
+// Builds the remapping of brightness for --auto-contrast, which stretches the range
+// between the darkest and brightest 0.5% of cells to 0-255, or --equalize, which maps
+// each brightness to the fraction of cells at or below it.
+void tone_curve(const uint32_t *histogram, const size_t total, const tone_mode mode, unsigned char *tone) {
+    size_t cumulative[256];
+    size_t sum = 0;
+    for(int i = 0; i < 256; i++) {
+        sum += histogram[i];
+        cumulative[i] = sum;
+    }
+    for(int i = 0; i < 256; i++) {
+        tone[i] = (unsigned char)i;
+    }
+    if(mode == TONE_EQUALIZE) {
+        int first = 0;
+        while(first < 255 && histogram[first] == 0) {
+            first++;
+        }
+        const size_t base = cumulative[first];
+        if(total > base) {
+            for(int i = first; i < 256; i++) {
+                tone[i] = (unsigned char)(((cumulative[i] - base) * 255 + (total - base) / 2) / (total - base));
+            }
+        }
+        return;
+    }
+    const size_t clip = total / 200;
+    int low = 0;
+    int high = 255;
+    while(low < 255 && cumulative[low] <= clip) {
+        low++;
+    }
+    while(high > 0 && cumulative[high - 1] >= total - clip) {
+        high--;
+    }
+    if(high <= low) {
+        return;
+    }
+    for(int i = 0; i < 256; i++) {
+        const int value = ((i - low) * 255 + (high - low) / 2) / (high - low);
+        tone[i] = (unsigned char)(value < 0 ? 0 : (value > 255 ? 255 : value));
+    }
+}
+
+// Writes the characters of each row of the art to dest, starting a row every pitch bytes
+// and leaving whatever lies between rows alone. Rows are split across the worker threads
+// when not dithering. With --edges, edges are drawn over the ramp or the dithered cells.
+//
+// Tone mapping needs the histogram of the whole grid before the first character, so the
+// brightness of each cell is kept as a byte in a first pass that also counts it, and the
+// characters then come from a 256 entry table of the tone curve and the ramp combined.
+// A grid whose brightness is already known goes straight to that table.
+void render_cells(const image_view *img, const config *conf, char *dest, const size_t pitch) {
+    const bool dithered = conf->dither != DITHER_NONE;
+    const int workers = lum_workers(img, conf->threads);
+    const size_t cell_count = (size_t)img->width * img->height;
+    unsigned char *toned = NULL;
+    const unsigned char *lum = img->lum;
+    char glyph_table[256];
+    unsigned char tone[256];
+    for(int i = 0; i < 256; i++) {
+        tone[i] = (unsigned char)i;
+    }
+    if(conf->tone != TONE_NONE) {
+        toned = arena_malloc(cell_count > 0 ? cell_count : 1);
+        uint32_t *histograms = arena_calloc((size_t)workers * 256, sizeof(uint32_t));
+        if(!toned || !histograms) {
+            fputs("Failed to allocate memory for tone mapping\n", stderr);
+            exit(1);
+        }
+        compute_lum(img, workers, toned, histograms);
+        for(int w = 1; w < workers; w++) {
+            for(int i = 0; i < 256; i++) {
+                histograms[i] += histograms[(size_t)w * 256 + i];
+            }
+        }
+        tone_curve(histograms, cell_count, conf->tone, tone);
+        arena_free(histograms);
+        lum = toned;
+    }
+    if(lum) {
+        const char *characters = conf->character_set;
+        const size_t chars_length = strlen(characters);
+        for(int i = 0; i < 256; i++) {
+            const size_t char_index = (int)(tone[i] / (255.1 / chars_length));
+            glyph_table[i] = conf->invert ? characters[chars_length - 1 - char_index] : characters[char_index];
+        }
+        if(toned && (dithered || conf->edges)) {
+            // These read brightness rather than characters, so get the toned values
+            for(size_t i = 0; i < cell_count; i++) {
+                toned[i] = tone[toned[i]];
+            }
+        }
+    }
+    if(dithered) {
+        dither_image(img, conf, lum, dest, pitch);
+    }
+    if(!dithered || conf->edges) {
+        char_ramp characters;
+        ramp_init(&characters, conf->character_set, conf->invert);
+        render_job job = {img, conf, dest, pitch, !dithered, lum, glyph_table, &characters};
+        run_workers(workers, conf->edges ? edge_rows_worker : map_rows_worker, &job);
+        ramp_free(&characters);
+    }
+    arena_free(toned);
+}
+
+// Writes the art as rows of width characters plus a newline, rendered_size(img) bytes in
+// total, straight into dest.
+void render_rows(const image_view *img, const config *conf, char *dest) {
+    for(int y = 0; y < img->height; y++) {
+        dest[(size_t)y * (img->width + 1) + img->width] = '\n';
+    }
+    render_cells(img, conf, dest, (size_t)img->width + 1);
+}
+
+char* image_to_string(const image_view *img, const config *conf) {
+    const size_t char_count = rendered_size(img) + 1;
+    char *result_str = arena_malloc(char_count);
+    if(result_str == NULL) {
+        return NULL;
+    }
+    render_rows(img, conf, result_str);
+    result_str[char_count - 1] = '\0';
+    return result_str;
+}
+
+typedef struct out_buffer {
+    char *data;
+    size_t length;
+    size_t capacity;
+} out_buffer;
+
+bool buffer_reserve(out_buffer *buf, const size_t extra) {
+    if(buf->length + extra <= buf->capacity) {
+        return true;
+    }
+    size_t capacity = buf->capacity ? buf->capacity : 4096;
+    while(capacity < buf->length + extra) {
+        capacity *= 2;
+    }
+    char *data = realloc(buf->data, capacity);
+    if(!data) {
+        return false;
+    }
+    buf->data = data;
+    buf->capacity = capacity;
+    return true;
+}
+
+// Callers reserve space first, so appends never need to check capacity.
+void buffer_append(out_buffer *buf, const char *text, const size_t length) {
+    memcpy(buf->data + buf->length, text, length);
+    buf->length += length;
+}
+
+#define BUFFER_APPEND_LITERAL(buf, literal) buffer_append(buf, literal, sizeof(literal) - 1)
+// Longest per-cell output: a closing tag, an opening tag with a color and an escaped glyph.
+#define MARKUP_CELL_MAX 64
+
+typedef struct escaped_glyph {
+    char text[7];
+    unsigned char length;
+} escaped_glyph;
+
+void build_escapes(escaped_glyph escapes[256]) {
+    for(int c = 0; c < 256; c++) {
+        const char *entity = c == '<' ? "&lt;" : c == '>' ? "&gt;" : c == '&' ? "&amp;" : NULL;
+        if(entity) {
+            escapes[c].length = (unsigned char)strlen(entity);
+            memcpy(escapes[c].text, entity, escapes[c].length);
+        }
+        else {
+            escapes[c].text[0] = (char)c;
+            escapes[c].length = 1;
+        }
+    }
+}
+
+uint32_t pixel_color(const image_view *img, const int x, const int y) {
+    const unsigned char *pixel = view_pixel(img, x, y);
+    const bool gray = img->channel_count < 3;
+    const uint32_t alpha = img->channel_count == 2 ? pixel[1] : img->channel_count == 4 ? pixel[3] : 255;
+    const uint32_t red = pixel[0] * alpha / 255;
+    const uint32_t green = (gray ? pixel[0] : pixel[1]) * alpha / 255;
+    const uint32_t blue = (gray ? pixel[0] : pixel[2]) * alpha / 255;
+    return (red << 16) | (green << 8) | blue;
+}
+
+void append_color(out_buffer *buf, const uint32_t color) {
+    static const char hex[] = "0123456789abcdef";
+    char text[7] = {'#'};
+    for(int i = 0; i < 6; i++) {
+        text[1 + i] = hex[(color >> (20 - 4 * i)) & 0xF];
+    }
+    buffer_append(buf, text, 7);
+}
+
+void append_number(out_buffer *buf, const int value) {
+    char text[16];
+    const int length = snprintf(text, sizeof(text), "%d", value);
+    buffer_append(buf, text, (size_t)length);
+}
+
+// Emits the art as colored HTML or SVG into buf, one element per run of equally colored
+// characters. Spaces never break a run since their color does not show.
+bool render_markup(const image_view *img, const config *conf, out_buffer *buf) {
+    const bool svg = conf->format == FORMAT_SVG;
+    const int cell_width = 6;
+    const int cell_height = 10;
+    char *rows = malloc(rendered_size(img) + 1);
+    if(!rows || !buffer_reserve(buf, (size_t)img->width * img->height * 8 + 512)) {
+        free(rows);
+        return false;
+    }
+    render_rows(img, conf, rows);
+    escaped_glyph escapes[256];
+    build_escapes(escapes);
+    const uint32_t background = conf->invert ? 0x000000 : 0xffffff;
+
+    if(svg) {
+        BUFFER_APPEND_LITERAL(buf, "<svg xmlns=\"http://www.w3.org/2000/svg\" xml:space=\"preserve\" width=\"");
+        append_number(buf, img->width * cell_width);
+        BUFFER_APPEND_LITERAL(buf, "\" height=\"");
+        append_number(buf, img->height * cell_height);
+        BUFFER_APPEND_LITERAL(buf, "\" font-family=\"monospace\" font-size=\"10\">\n<rect width=\"100%\" height=\"100%\" fill=\"");
+        append_color(buf, background);
+        BUFFER_APPEND_LITERAL(buf, "\"/>\n");
+    }
+    else {
+        BUFFER_APPEND_LITERAL(buf, "<pre style=\"font-family:monospace;line-height:1;background:");
+        append_color(buf, background);
+        BUFFER_APPEND_LITERAL(buf, "\">\n");
+    }
+
+    for(int y = 0; y < img->height; y++) {
+        const char *row = rows + (size_t)y * (img->width + 1);
+        if(!buffer_reserve(buf, (size_t)img->width * MARKUP_CELL_MAX + 64)) {
+            free(rows);
+            return false;
+        }
+        if(svg) {
+            BUFFER_APPEND_LITERAL(buf, "<text y=\"");
+            append_number(buf, (y + 1) * cell_height - 2);
+            BUFFER_APPEND_LITERAL(buf, "\">");
+        }
+        bool open = false;
+        uint32_t run_color = 0;
+        for(int x = 0; x < img->width; x++) {
+            const unsigned char glyph = (unsigned char)row[x];
+            const uint32_t color = pixel_color(img, x, y);
+            if(!open || (color != run_color && glyph != ' ')) {
+                if(open) {
+                    if(svg) {
+                        BUFFER_APPEND_LITERAL(buf, "</tspan>");
+                    }
+                    else {
+                        BUFFER_APPEND_LITERAL(buf, "</span>");
+                    }
+                }
+                if(svg) {
+                    BUFFER_APPEND_LITERAL(buf, "<tspan fill=\"");
+                }
+                else {
+                    BUFFER_APPEND_LITERAL(buf, "<span style=\"color:");
+                }
+                append_color(buf, color);
+                BUFFER_APPEND_LITERAL(buf, "\">");
+                open = true;
+                run_color = color;
+            }
+            buffer_append(buf, escapes[glyph].text, escapes[glyph].length);
+        }
+        if(open) {
+            if(svg) {
+                BUFFER_APPEND_LITERAL(buf, "</tspan>");
+            }
+            else {
+                BUFFER_APPEND_LITERAL(buf, "</span>");
+            }
+        }
+        if(svg) {
+            BUFFER_APPEND_LITERAL(buf, "</text>\n");
+        }
+        else {
+            BUFFER_APPEND_LITERAL(buf, "\n");
+        }
+    }
+    if(!buffer_reserve(buf, 16)) {
+        free(rows);
+        return false;
+    }
+    if(svg) {
+        BUFFER_APPEND_LITERAL(buf, "</svg>\n");
+    }
+    else {
+        BUFFER_APPEND_LITERAL(buf, "</pre>\n");
+    }
+    free(rows);
+    return true;
+}
+
+// Reports why filename couldn't be decoded and returns the status for it. A batch goes
+// on to its next image.
+int load_error(const char *filename) {
+    const char *reason = stbi_failure_reason();
+    fprintf(stderr, "Error loading image %s: %s", filename, reason);
+    if(strcmp(reason, "can't fopen") == 0) {
+        fputs(" - the file may not exist.", stderr);
+    }
+    fputs("\n", stderr);
+    return 1;
+}
+
+// Decodes the whole image. Returns false, with stbi_failure_reason() saying why, when it
+// can't be read.
+bool open_image(image_data *img, const input_file *in) {
+    int width, height, channel_count;
+    unsigned char *data = in->data ? stbi_load_from_memory(in->data, (int)in->size, &width, &height, &channel_count, 0)
+                                   : stbi_load(in->name, &width, &height, &channel_count, 0);
+    if(!data) {
+        return false;
+    }
+    img->data = data;
+    img->width = width;
+    img->height = height;
+    img->channel_count = channel_count;
+    img->stride = 0;
+    return true;
+}
+
+// Reads only the image header, so the output grid can be planned before decoding.
+bool probe_image(image_data *img, const input_file *in) {
+    int width, height, channel_count;
+    if(!(in->data ? stbi_info_from_memory(in->data, (int)in->size, &width, &height, &channel_count)
+                  : stbi_info(in->name, &width, &height, &channel_count))) {
+        return false;
+    }
+    img->data = NULL;
+    img->width = width;
+    img->height = height;
+    img->channel_count = channel_count;
+    img->stride = 0;
+    return true;
+}
+
+// What rendering in is likely to take from its arena, judged from its header
+size_t render_hint(const input_file *in) {
     image_data img;
-    open_image(&img, conf.filename);
-    free(conf.filename);
-    if(conf.w_scaling != 1.0 || conf.h_scaling != 1.0)
-        scale_image(&img, conf.w_scaling, conf.h_scaling);
-    char *art = image_to_string(&img, conf.invert, conf.character_set);
-    free(conf.character_set);
+    return probe_image(&img, in) ? arena_hint(img.width, img.height, img.channel_count) : in->size;
+}
+
+unsigned char* read_file(const char *filename, size_t *size) {
+    FILE *f = fopen(filename, "rb");
+    if(!f) {
+        return NULL;
+    }
+    unsigned char *data = NULL;
+    long length = -1;
+    if(fseek(f, 0, SEEK_END) == 0) {
+        length = ftell(f);
+    }
+    if(length >= 0 && fseek(f, 0, SEEK_SET) == 0) {
+        data = malloc(length > 0 ? (size_t)length : 1);
+        if(data && fread(data, 1, (size_t)length, f) != (size_t)length) {
+            free(data);
+            data = NULL;
+        }
+    }
+    fclose(f);
+    *size = length > 0 ? (size_t)length : 0;
+    return data;
+}
+
+// The whole of in, either the contents read ahead or a fresh read of the file. Give it back
+// with release_input.
+unsigned char* read_input(const input_file *in, size_t *size) {
+    if(in->data) {
+        *size = in->size;
+        return in->data;
+    }
+    return read_file(in->name, size);
+}
+
+void release_input(const input_file *in, unsigned char *data) {
+    if(data != in->data) {
+        free(data);
+    }
+}
+
+// Copies up to count bytes from the start of in into dest, returning how many there were.
+size_t read_input_start(const input_file *in, unsigned char *dest, const size_t count) {
+    if(in->data) {
+        const size_t available = in->size < count ? in->size : count;
+        memcpy(dest, in->data, available);
+        return available;
+    }
+    FILE *f = fopen(in->name, "rb");
+    if(!f) {
+        return 0;
+    }
+    const size_t read = fread(dest, 1, count, f);
+    fclose(f);
+    return read;
+}
+
+#if defined(ASCIIGEN_URING)
+// The parts of an io_uring instance that reads are submitted and completed through,
+// driven with the raw system calls
+typedef struct uring {
+    int fd;
+    unsigned char *sq_ring;
+    size_t sq_ring_size;
+    unsigned char *cq_ring;
+    size_t cq_ring_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+} uring;
+
+void uring_close(uring *ring) {
+    if(ring->sqes) {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+    if(ring->cq_ring && ring->cq_ring != ring->sq_ring) {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    if(ring->sq_ring) {
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    }
+    close(ring->fd);
+}
+
+// Sets up a ring for entries reads at a time. Fails where io_uring is missing or blocked.
+bool uring_open(uring *ring, const unsigned entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+    if(ring->fd < 0) {
+        return false;
+    }
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    const bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if(single_mmap) {
+        ring->sq_ring_size = ring->sq_ring_size > ring->cq_ring_size ? ring->sq_ring_size : ring->cq_ring_size;
+    }
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if(ring->sq_ring == MAP_FAILED) {
+        ring->sq_ring = NULL;
+        uring_close(ring);
+        return false;
+    }
+    ring->cq_ring = single_mmap ? ring->sq_ring
+                                : mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if(ring->cq_ring == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        ring->cq_ring = ring->cq_ring == MAP_FAILED ? NULL : ring->cq_ring;
+        ring->sqes = ring->sqes == MAP_FAILED ? NULL : ring->sqes;
+        uring_close(ring);
+        return false;
+    }
+    ring->sq_tail = (unsigned*)(ring->sq_ring + params.sq_off.tail);
+    ring->sq_mask = (unsigned*)(ring->sq_ring + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned*)(ring->sq_ring + params.sq_off.array);
+    ring->cq_head = (unsigned*)(ring->cq_ring + params.cq_off.head);
+    ring->cq_tail = (unsigned*)(ring->cq_ring + params.cq_off.tail);
+    ring->cq_mask = (unsigned*)(ring->cq_ring + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(ring->cq_ring + params.cq_off.cqes);
+    return true;
+}
+
+// Submits a read of length bytes at offset of fd into dest, tagged with user_data.
+bool uring_read(uring *ring, const int fd, void *dest, const unsigned length, const uint64_t offset, const uint64_t user_data) {
+    const unsigned tail = *ring->sq_tail;
+    const unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)dest;
+    sqe->len = length;
+    sqe->off = offset;
+    sqe->user_data = user_data;
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    long submitted;
+    do {
+        submitted = syscall(__NR_io_uring_enter, ring->fd, 1, 0, 0, NULL, 0);
+    } while(submitted < 0 && errno == EINTR);
+    return submitted == 1;
+}
+
+// Takes the next completion, waiting for one to arrive.
+bool uring_complete(uring *ring, struct io_uring_cqe *cqe) {
+    const unsigned head = *ring->cq_head;
+    while(head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        if(syscall(__NR_io_uring_enter, ring->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR) {
+            return false;
+        }
+    }
+    *cqe = ring->cqes[head & *ring->cq_mask];
+    __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+#endif
+
+// Reads the files of a batch ahead of the one being rendered, keeping up to depth reads
+// in flight, so decoding one file overlaps reading the next. Reads go through io_uring
+// where the kernel allows it, and otherwise a readahead thread reads one file after
+// another. Files that can't be read ahead keep a NULL data pointer and are read from disk
+// when rendered, so errors are reported the usual way.
+typedef struct prefetcher {
+    input_file *files;
+    bool *ready;
+    int count;
+    int depth;
+    int taken;
+    const char *method;
+#if defined(ASCIIGEN_URING)
+    uring ring;
+    bool use_ring;
+    int submitted;
+    int *fds;
+    size_t *read;
+#endif
+#if defined(ASCIIGEN_THREADS)
+    pthread_t thread;
+    bool use_thread;
+    bool stopping;
+    pthread_mutex_t lock;
+    pthread_cond_t progress;
+#endif
+} prefetcher;
+
+#if defined(ASCIIGEN_URING)
+// Reads at most this much per request, so lengths fit the 32 bit field
+#define PREFETCH_READ_MAX (1u << 30)
+
+void prefetch_finish(prefetcher *pf, const int i) {
+    if(pf->fds[i] >= 0) {
+        close(pf->fds[i]);
+        pf->fds[i] = -1;
+    }
+    if(pf->files[i].data && pf->files[i].size == 0) {
+        free(pf->files[i].data);
+        pf->files[i].data = NULL;
+    }
+    pf->ready[i] = true;
+}
+
+bool prefetch_read_next(prefetcher *pf, const int i) {
+    const size_t remaining = pf->files[i].size - pf->read[i];
+    const unsigned length = remaining < PREFETCH_READ_MAX ? (unsigned)remaining : PREFETCH_READ_MAX;
+    return uring_read(&pf->ring, pf->fds[i], pf->files[i].data + pf->read[i], length, pf->read[i], (uint64_t)i);
+}
+
+void prefetch_submit(prefetcher *pf, const int i) {
+    struct stat st;
+    pf->fds[i] = open(pf->files[i].name, O_RDONLY);
+    if(pf->fds[i] < 0 || fstat(pf->fds[i], &st) != 0 || st.st_size <= 0) {
+        prefetch_finish(pf, i);
+        return;
+    }
+    pf->files[i].size = (size_t)st.st_size;
+    pf->files[i].data = malloc(pf->files[i].size);
+    pf->read[i] = 0;
+    if(!pf->files[i].data || !prefetch_read_next(pf, i)) {
+        free(pf->files[i].data);
+        pf->files[i].data = NULL;
+        prefetch_finish(pf, i);
+    }
+}
+
+// Gives up on the ring after it stops delivering completions. The buffers of reads still
+// in flight are left alone, as the kernel may yet write to them, and the files they were
+// for are read from disk when rendered.
+void prefetch_abandon(prefetcher *pf) {
+    for(int i = 0; i < pf->submitted; i++) {
+        if(!pf->ready[i]) {
+            pf->files[i].data = NULL;
+            pf->ready[i] = true;
+        }
+    }
+    pf->use_ring = false;
+}
+
+// Handles one completed read, asking for the rest of the file after a short one.
+bool prefetch_complete(prefetcher *pf) {
+    struct io_uring_cqe cqe;
+    if(!uring_complete(&pf->ring, &cqe)) {
+        return false;
+    }
+    const int i = (int)cqe.user_data;
+    if(cqe.res > 0) {
+        pf->read[i] += (size_t)cqe.res;
+        if(pf->read[i] < pf->files[i].size && prefetch_read_next(pf, i)) {
+            return true;
+        }
+    }
+    if(cqe.res < 0 || pf->read[i] < pf->files[i].size) {
+        // A failed read, or a file that shrank, is read again from disk when rendered
+        free(pf->files[i].data);
+        pf->files[i].data = NULL;
+    }
+    prefetch_finish(pf, i);
+    return true;
+}
+#endif
+
+#if defined(ASCIIGEN_THREADS)
+void* prefetch_thread(void *arg) {
+    prefetcher *pf = arg;
+    for(int i = 0; i < pf->count; i++) {
+        pthread_mutex_lock(&pf->lock);
+        while(!pf->stopping && i > pf->taken + pf->depth) {
+            pthread_cond_wait(&pf->progress, &pf->lock);
+        }
+        const bool stopping = pf->stopping;
+        pthread_mutex_unlock(&pf->lock);
+        if(stopping) {
+            break;
+        }
+        size_t size;
+        unsigned char *data = read_file(pf->files[i].name, &size);
+        if(data && size == 0) {
+            free(data);
+            data = NULL;
+        }
+        pthread_mutex_lock(&pf->lock);
+        pf->files[i].data = data;
+        pf->files[i].size = size;
+        pf->ready[i] = true;
+        pthread_cond_broadcast(&pf->progress);
+        pthread_mutex_unlock(&pf->lock);
+    }
+    return NULL;
+}
+#endif
+
+// Starts reading up to depth files ahead. A depth of 0 reads nothing ahead.
+void prefetch_start(prefetcher *pf, char **filenames, const int count, const int depth) {
+    memset(pf, 0, sizeof(*pf));
+    pf->files = calloc(count, sizeof(input_file));
+    pf->ready = calloc(count, sizeof(bool));
+    if(!pf->files || !pf->ready) {
+        fputs("Error allocating memory for input files...\n", stderr);
+        exit(1);
+    }
+    for(int i = 0; i < count; i++) {
+        pf->files[i].name = filenames[i];
+    }
+    pf->count = count;
+    pf->depth = depth;
+    pf->method = "none";
+    if(depth <= 0) {
+        return;
+    }
+#if defined(ASCIIGEN_URING)
+    pf->fds = malloc(sizeof(int) * count);
+    pf->read = calloc(count, sizeof(size_t));
+    if(pf->fds && pf->read && uring_open(&pf->ring, (unsigned)depth + 1)) {
+        for(int i = 0; i < count; i++) {
+            pf->fds[i] = -1;
+        }
+        pf->use_ring = true;
+        pf->method = "io_uring";
+        return;
+    }
+#endif
+#if defined(ASCIIGEN_THREADS)
+    pthread_mutex_init(&pf->lock, NULL);
+    pthread_cond_init(&pf->progress, NULL);
+    pf->use_thread = pthread_create(&pf->thread, NULL, prefetch_thread, pf) == 0;
+    if(pf->use_thread) {
+        pf->method = "readahead thread";
+    }
+    else {
+        pthread_cond_destroy(&pf->progress);
+        pthread_mutex_destroy(&pf->lock);
+    }
+#endif
+}
+
+// Returns file i, waiting for it to be read ahead, and lets reads of the files after it start.
+input_file* prefetch_take(prefetcher *pf, const int i) {
+#if defined(ASCIIGEN_URING)
+    if(pf->use_ring) {
+        for(; pf->submitted < pf->count && pf->submitted <= i + pf->depth; pf->submitted++) {
+            prefetch_submit(pf, pf->submitted);
+        }
+        while(!pf->ready[i] && prefetch_complete(pf)) {
+        }
+        if(!pf->ready[i]) {
+            prefetch_abandon(pf);
+        }
+    }
+#endif
+#if defined(ASCIIGEN_THREADS)
+    if(pf->use_thread) {
+        pthread_mutex_lock(&pf->lock);
+        pf->taken = i;
+        pthread_cond_broadcast(&pf->progress);
+        while(!pf->ready[i]) {
+            pthread_cond_wait(&pf->progress, &pf->lock);
+        }
+        pthread_mutex_unlock(&pf->lock);
+    }
+#endif
+    return &pf->files[i];
+}
+
+void prefetch_release(prefetcher *pf, const int i) {
+    free(pf->files[i].data);
+    pf->files[i].data = NULL;
+}
+
+// Waits for reads still in flight and frees everything read ahead.
+void prefetch_stop(prefetcher *pf) {
+#if defined(ASCIIGEN_URING)
+    if(pf->use_ring) {
+        for(int i = 0; i < pf->submitted; i++) {
+            while(!pf->ready[i] && prefetch_complete(pf)) {
+            }
+        }
+        prefetch_abandon(pf);
+        uring_close(&pf->ring);
+    }
+    free(pf->fds);
+    free(pf->read);
+#endif
+#if defined(ASCIIGEN_THREADS)
+    if(pf->use_thread) {
+        pthread_mutex_lock(&pf->lock);
+        pf->stopping = true;
+        pthread_cond_broadcast(&pf->progress);
+        pthread_mutex_unlock(&pf->lock);
+        pthread_join(pf->thread, NULL);
+        pthread_cond_destroy(&pf->progress);
+        pthread_mutex_destroy(&pf->lock);
+    }
+#endif
+    for(int i = 0; i < pf->count; i++) {
+        free(pf->files[i].data);
+    }
+    free(pf->files);
+    free(pf->ready);
+}
+
+typedef struct mapped_file {
+    unsigned char *data;
+    size_t size;
+} mapped_file;
+
+#if !defined(_WIN32)
+// Reads the unsigned number at *pos of a PNM header, skipping the whitespace and comments
+// before it. Returns -1 if there is none.
+long pnm_number(const unsigned char *data, const size_t size, size_t *pos) {
+    while(*pos < size && (isspace(data[*pos]) || data[*pos] == '#')) {
+        if(data[*pos] == '#') {
+            while(*pos < size && data[*pos] != '\n') {
+                (*pos)++;
+            }
+        }
+        else {
+            (*pos)++;
+        }
+    }
+    long value = -1;
+    while(*pos < size && isdigit(data[*pos]) && value < 1L << 24) {
+        value = (value < 0 ? 0 : value * 10) + (data[*pos] - '0');
+        (*pos)++;
+    }
+    return value;
+}
+
+// Reads the header of a binary PGM or PPM with a maxval of 255 from the first size bytes
+// of a file of total bytes, setting img to the size of its pixels and *offset to where
+// they start. Returns false for any other file.
+bool pnm_layout(const unsigned char *data, const size_t size, const size_t total, image_data *img, size_t *offset) {
+    if(size < 2 || data[0] != 'P' || (data[1] != '5' && data[1] != '6')) {
+        return false;
+    }
+    size_t pos = 2;
+    const long width = pnm_number(data, size, &pos);
+    const long height = pnm_number(data, size, &pos);
+    const long maxval = pnm_number(data, size, &pos);
+    const int channel_count = data[1] == '6' ? 3 : 1;
+    // A single whitespace character separates the header from the pixels
+    if(width <= 0 || height <= 0 || width > STBI_MAX_DIMENSIONS || height > STBI_MAX_DIMENSIONS ||
+       maxval != 255 || pos >= size || !isspace(data[pos]) ||
+       (total - pos - 1) / ((size_t)width * channel_count) < (size_t)height) {
+        return false;
+    }
+    img->width = (int)width;
+    img->height = (int)height;
+    img->channel_count = channel_count;
+    img->stride = 0;
+    *offset = pos + 1;
+    return true;
+}
+
+// Binary PGM and PPM files with a maxval of 255 already hold pixels the way asciigen reads
+// them, so rather than decoding they are mapped and img points straight at the pixels in
+// the mapping. Pages are only read as resizing and mapping touch them. Returns false for
+// any other file, which then goes through stbi_load.
+bool map_pnm(const input_file *in, image_data *img, mapped_file *map, decode_info *info) {
+    unsigned char magic[2] = {0, 0};
+    if(read_input_start(in, magic, 2) != 2 || magic[0] != 'P' || (magic[1] != '5' && magic[1] != '6')) {
+        return false;
+    }
+    // Contents already read ahead are used where they are instead
+    unsigned char *data = in->data;
+    size_t size = in->size;
+    if(!data) {
+        const int fd = open(in->name, O_RDONLY);
+        struct stat st;
+        if(fd < 0) {
+            return false;
+        }
+        if(fstat(fd, &st) != 0 || st.st_size < 8) {
+            close(fd);
+            return false;
+        }
+        size = (size_t)st.st_size;
+        data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if(data == MAP_FAILED) {
+            return false;
+        }
+    }
+    size_t offset;
+    if(!pnm_layout(data, size, size, img, &offset)) {
+        if(data != in->data) {
+            munmap(data, size);
+        }
+        return false;
+    }
+    map->data = data != in->data ? data : NULL;
+    map->size = size;
+    img->data = data + offset;
+    info->method = "mapped";
+    return true;
+}
+
+void unmap_file(mapped_file *map) {
+    if(map->data) {
+        munmap(map->data, map->size);
+        map->data = NULL;
+    }
+}
+#endif
+
+// Makes sure the crop lies within the image, trimming it at the right and bottom edges.
+void clamp_crop(crop_rect *crop, const int width, const int height, const char *filename) {
+    if(crop->x >= width || crop->y >= height) {
+        fprintf(stderr, "Crop region starts outside the %dx%d image %s\n", width, height, filename);
+        exit(1);
+    }
+    if(crop->width > width - crop->x) {
+        crop->width = width - crop->x;
+    }
+    if(crop->height > height - crop->y) {
+        crop->height = height - crop->y;
+    }
+}
+
+// Moves the crop region to the start of the pixel buffer, in place.
+void crop_image(image_data *img, const crop_rect *crop) {
+    const size_t row_bytes = (size_t)crop->width * img->channel_count;
+    for(int y = 0; y < crop->height; y++) {
+        const size_t src_offset = ((size_t)(crop->y + y) * img->width + crop->x) * img->channel_count;
+        memmove(img->data + y * row_bytes, img->data + src_offset, row_bytes);
+    }
+    img->width = crop->width;
+    img->height = crop->height;
+}
+
+// Crops an image whose pixels it can't move, such as a mapped file, by pointing data at the
+// crop region and keeping the full row stride.
+void crop_strided(image_data *img, const crop_rect *crop) {
+    const size_t stride = img->stride ? img->stride : (size_t)img->width * img->channel_count;
+    img->data += (size_t)crop->y * stride + (size_t)crop->x * img->channel_count;
+    img->stride = stride;
+    img->width = crop->width;
+    img->height = crop->height;
+}
+
+// Converts a crop given in the pixels of the image as orientation shows it to the pixels
+// of the stored width x height image.
+crop_rect orient_crop(const crop_rect *crop, const int orientation, const int width, const int height) {
+    const bool transpose = orientation & ORIENT_TRANSPOSE;
+    const int shown_width = transpose ? height : width;
+    const int shown_height = transpose ? width : height;
+    const int along_x = orientation & ORIENT_FLIP_X ? shown_width - crop->x - crop->width : crop->x;
+    const int along_y = orientation & ORIENT_FLIP_Y ? shown_height - crop->y - crop->height : crop->y;
+    crop_rect result = {along_x, along_y, crop->width, crop->height};
+    if(transpose) {
+        result.x = along_y;
+        result.y = along_x;
+        result.width = crop->height;
+        result.height = crop->width;
+    }
+    return result;
+}
+
+uint32_t read_be32(const unsigned char *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+// A PNG decoder that inflates block by block through stb_image's zlib internals, so
+// decoding can stop, or hand rows on, as soon as the rows it needs are available.
+// Handles 8 and 16 bit images, everything else goes through stbi_load.
+typedef struct png_decoder {
+    int width;
+    int height;
+    int depth;
+    int color;
+    int interlaced;
+    int channels;
+    int out_channels;
+    unsigned char palette[1024];
+    unsigned char *idat;
+    size_t idat_length;
+    bool idat_owned;
+    stbi__zbuf z;
+    unsigned char *raw;
+    size_t raw_capacity;
+    size_t inflated;
+    bool finished;
+} png_decoder;
+
+size_t png_row_bytes(const png_decoder *png) {
+    return (size_t)png->width * png->channels * (png->depth / 8);
+}
+
+bool png_open_header(png_decoder *png, const unsigned char *data, const size_t size) {
+    static const unsigned char signature[8] = {137, 80, 78, 71, 13, 10, 26, 10};
+    memset(png, 0, sizeof(*png));
+    if(size < 33 || memcmp(data, signature, 8) != 0 || memcmp(data + 12, "IHDR", 4) != 0) {
+        return false;
+    }
+    png->width = (int)read_be32(data + 16);
+    png->height = (int)read_be32(data + 20);
+    png->depth = data[24];
+    png->color = data[25];
+    png->interlaced = data[28];
+    if(png->width <= 0 || png->height <= 0 || png->width > STBI_MAX_DIMENSIONS || png->height > STBI_MAX_DIMENSIONS) {
+        return false;
+    }
+    if(png->depth != 8 && !(png->depth == 16 && png->color != 3)) {
+        return false;
+    }
+    switch(png->color) {
+        case 0: png->channels = 1; break;
+        case 2: png->channels = 3; break;
+        case 3: png->channels = 1; break;
+        case 4: png->channels = 2; break;
+        case 6: png->channels = 4; break;
+        default: return false;
+    }
+    png->out_channels = png->color == 3 ? 3 : png->channels;
+    return (1 << 30) / png->width / 4 >= png->height && png->interlaced <= 1;
+}
+
+bool png_open(png_decoder *png, const unsigned char *data, const size_t size) {
+    if(!png_open_header(png, data, size)) {
+        return false;
+    }
+    size_t offset = 8;
+    size_t idat_capacity = 0;
+    bool has_palette = false;
+    bool ended = false;
+    while(!ended && offset + 12 <= size) {
+        const uint32_t length = read_be32(data + offset);
+        const unsigned char *type = data + offset + 4;
+        const unsigned char *body = data + offset + 8;
+        if(length > size - offset - 12) {
+            break;
+        }
+        if(memcmp(type, "PLTE", 4) == 0 && length <= 768 && length % 3 == 0) {
+            for(uint32_t i = 0; i < length / 3; i++) {
+                memcpy(png->palette + i * 4, body + i * 3, 3);
+                png->palette[i * 4 + 3] = 255;
+            }
+            has_palette = true;
+        }
+        else if(memcmp(type, "tRNS", 4) == 0) {
+            if(png->color != 3 || length > 256) {
+                break;
+            }
+            for(uint32_t i = 0; i < length; i++) {
+                png->palette[i * 4 + 3] = body[i];
+            }
+            png->out_channels = 4;
+        }
+        else if(memcmp(type, "IDAT", 4) == 0) {
+            if(png->idat_length == 0 && !png->idat_owned) {
+                png->idat = (unsigned char*)body;
+            }
+            else {
+                if(!png->idat_owned) {
+                    unsigned char *first = png->idat;
+                    idat_capacity = (png->idat_length + length) * 2;
+                    png->idat = arena_malloc(idat_capacity);
+                    if(!png->idat) {
+                        return false;
+                    }
+                    memcpy(png->idat, first, png->idat_length);
+                    png->idat_owned = true;
+                }
+                else if(png->idat_length + length > idat_capacity) {
+                    idat_capacity = (png->idat_length + length) * 2;
+                    unsigned char *grown = arena_realloc(png->idat, idat_capacity);
+                    if(!grown) {
+                        return false;
+                    }
+                    png->idat = grown;
+                }
+                memcpy(png->idat + png->idat_length, body, length);
+            }
+            png->idat_length += length;
+        }
+        else if(memcmp(type, "IEND", 4) == 0) {
+            ended = true;
+        }
+        else if(!(type[0] & 32) && memcmp(type, "IHDR", 4) != 0) {
+            // unknown critical chunks (including Apple's CgBI) are left to stb_image
+            break;
+        }
+        offset += 12 + length;
+    }
+    if(!ended || png->idat_length == 0 || (png->color == 3 && !has_palette)) {
+        return false;
+    }
+    return true;
+}
+
+void png_close(png_decoder *png) {
+    if(png->idat_owned) {
+        arena_free(png->idat);
+    }
+    arena_free(png->raw);
+    png->idat = NULL;
+    png->raw = NULL;
+}
+
+// The buffer png_inflate_to is filling on this thread, and whether stb_image asked to grow it
+static STBI_THREAD_LOCAL const void *inflate_buffer;
+static STBI_THREAD_LOCAL bool inflate_full;
+
+// Every sized realloc in stb_image comes through here. Growing the inflate buffer is
+// refused and flagged, which ends the block at the last byte that fit.
+void* inflate_realloc(void *p, const size_t old_size, const size_t size) {
+    (void)old_size;
+    if(p && p == inflate_buffer) {
+        inflate_full = true;
+        return NULL;
+    }
+    return arena_realloc(p, size);
+}
+
+// Prepares to inflate into a buffer of capacity bytes. When a block runs out of room
+// stb_image has already written everything before the symbol that didn't fit, so the
+// output is complete up to where it stopped. A stored block is copied all at once (up to
+// 65535 bytes) and a match is at most 258 bytes, so callers add that much beyond the rows
+// they need to be sure anything starting before them is finished.
+bool png_begin_inflate(png_decoder *png, const size_t capacity) {
+    png->raw = arena_malloc(capacity);
+    if(!png->raw) {
+        return false;
+    }
+    png->raw_capacity = capacity;
+    png->z.zbuffer = png->idat;
+    png->z.zbuffer_end = png->idat + png->idat_length;
+    png->z.zout_start = (char*)png->raw;
+    png->z.zout = (char*)png->raw;
+    png->z.zout_end = (char*)png->raw + capacity;
+    png->z.z_expandable = 1;
+    if(!stbi__parse_zlib_header(&png->z)) {
+        return false;
+    }
+    png->z.num_bits = 0;
+    png->z.code_buffer = 0;
+    png->z.hit_zeof_once = 0;
+    return true;
+}
+
+// Inflates whole deflate blocks until at least target bytes are available or the stream ends.
+bool png_inflate_to(png_decoder *png, const size_t target) {
+    stbi__zbuf *z = &png->z;
+    inflate_full = false;
+    while(!png->finished && png->inflated < target) {
+        const int final = stbi__zreceive(z, 1);
+        const int type = stbi__zreceive(z, 2);
+        bool ok;
+        inflate_buffer = z->zout_start;
+        if(type == 0) {
+            ok = stbi__parse_uncompressed_block(z);
+        }
+        else if(type == 3) {
+            ok = false;
+        }
+        else {
+            if(type == 1) {
+                ok = stbi__zbuild_huffman(&z->z_length, stbi__zdefault_length, STBI__ZNSYMS) &&
+                     stbi__zbuild_huffman(&z->z_distance, stbi__zdefault_distance, 32);
+            }
+            else {
+                ok = stbi__compute_huffman_codes(z);
+            }
+            ok = ok && stbi__parse_huffman_block(z);
+        }
+        inflate_buffer = NULL;
+        png->inflated = (size_t)(z->zout - z->zout_start);
+        if(!ok) {
+            return png->inflated >= target && inflate_full;
+        }
+        png->finished = final;
+    }
+    return png->inflated >= target;
+}
+
+size_t png_consumed(const png_decoder *png) {
+    const size_t read = (size_t)(png->z.zbuffer - png->idat);
+    const size_t buffered = (size_t)(png->z.num_bits > 0 ? png->z.num_bits / 8 : 0);
+    return read > buffered ? read - buffered : 0;
+}
+
+bool png_unfilter_row(unsigned char *row, const unsigned char *prior, const size_t length, const int bpp, const int filter) {
+    switch(filter) {
+        case 0:
+            break;
+        case 1:
+            for(size_t k = bpp; k < length; k++) {
+                row[k] = (unsigned char)(row[k] + row[k - bpp]);
+            }
+            break;
+        case 2:
+            for(size_t k = 0; k < length; k++) {
+                row[k] = (unsigned char)(row[k] + prior[k]);
+            }
+            break;
+        case 3:
+            for(size_t k = 0; k < (size_t)bpp; k++) {
+                row[k] = (unsigned char)(row[k] + (prior[k] >> 1));
+            }
+            for(size_t k = bpp; k < length; k++) {
+                row[k] = (unsigned char)(row[k] + ((prior[k] + row[k - bpp]) >> 1));
+            }
+            break;
+        case 4:
+            for(size_t k = 0; k < (size_t)bpp; k++) {
+                row[k] = (unsigned char)(row[k] + prior[k]);
+            }
+            for(size_t k = bpp; k < length; k++) {
+                row[k] = (unsigned char)(row[k] + stbi__paeth(row[k - bpp], prior[k], prior[k - bpp]));
+            }
+            break;
+        default:
+            return false;
+    }
+    return true;
+}
+
+// Converts columns [x_begin, x_end) of an unfiltered row to 8 bits per channel, expanding palettes.
+void png_expand_row(const png_decoder *png, const unsigned char *row, unsigned char *dest, const int x_begin, const int x_end) {
+    if(png->color == 3) {
+        for(int x = x_begin; x < x_end; x++) {
+            memcpy(dest, png->palette + row[x] * 4, png->out_channels);
+            dest += png->out_channels;
+        }
+    }
+    else if(png->depth == 16) {
+        const size_t count = (size_t)(x_end - x_begin) * png->channels;
+        const unsigned char *src = row + (size_t)x_begin * png->channels * 2;
+        for(size_t i = 0; i < count; i++) {
+            dest[i] = src[i * 2];
+        }
+    }
+    else {
+        memcpy(dest, row + (size_t)x_begin * png->channels, (size_t)(x_end - x_begin) * png->channels);
+    }
+}
+
+// Reads just the IHDR chunk of filename into png, returning whether this decoder handles it.
+bool png_probe(const input_file *in, png_decoder *png) {
+    unsigned char header[33];
+    return read_input_start(in, header, sizeof(header)) == sizeof(header) && png_open_header(png, header, sizeof(header));
+}
+
+// Checks from the IHDR chunk alone whether decode_png_region can handle a file.
+bool png_rows_supported(const input_file *in) {
+    png_decoder png;
+    return png_probe(in, &png) && !png.interlaced;
+}
+
+bool png_interlaced(const input_file *in) {
+    png_decoder png;
+    return png_probe(in, &png) && png.interlaced;
+}
+
+// Decodes only the crop region of a PNG. Rows above the crop still have to be unfiltered,
+// but inflate stops at the first block boundary past the crop's last row. Returns false
+// when this path does not handle the file, which then goes through the full decode.
+bool decode_png_region(const input_file *in, const crop_rect *crop, image_data *img, decode_info *info) {
+    size_t size;
+    unsigned char *file = read_input(in, &size);
+    if(!file) {
+        return false;
+    }
+    png_decoder png;
+    bool ok = png_open(&png, file, size) && !png.interlaced &&
+              crop->x + crop->width <= png.width && crop->y + crop->height <= png.height;
+    const size_t stride = png_row_bytes(&png) + 1;
+    const size_t full = stride * png.height;
+    const size_t target = stride * (crop->y + crop->height);
+    const size_t slack = 65535 + 258;
+    ok = ok && png_begin_inflate(&png, target + slack < full ? target + slack : full) && png_inflate_to(&png, target);
+    unsigned char *pixels = ok ? arena_malloc((size_t)crop->width * crop->height * png.out_channels) : NULL;
+    unsigned char *zero_row = ok ? arena_calloc(stride, 1) : NULL;
+    ok = ok && pixels && zero_row;
+    const int bpp = png.channels * (png.depth / 8);
+    for(int y = 0; ok && y < crop->y + crop->height; y++) {
+        unsigned char *row = png.raw + y * stride;
+        const unsigned char *prior = y > 0 ? row - stride + 1 : zero_row;
+        ok = png_unfilter_row(row + 1, prior, stride - 1, bpp, row[0]);
+        if(ok && y >= crop->y) {
+            png_expand_row(&png, row + 1, pixels + (size_t)(y - crop->y) * crop->width * png.out_channels, crop->x, crop->x + crop->width);
+        }
+    }
+    if(ok) {
+        img->data = pixels;
+        img->width = crop->width;
+        img->height = crop->height;
+        img->channel_count = png.out_channels;
+        info->method = "rows";
+        info->compressed_used = png_consumed(&png);
+        info->compressed_total = png.idat_length;
+    }
+    else {
+        arena_free(pixels);
+    }
+    arena_free(zero_row);
+    png_close(&png);
+    release_input(in, file);
+    return ok;
+}
+
+// Adam7 passes as x start, y start, x step and y step
+static const int adam7_passes[7][4] = {
+    {0, 0, 8, 8}, {4, 0, 8, 8}, {0, 4, 4, 8}, {2, 0, 4, 4}, {0, 2, 2, 4}, {1, 0, 2, 2}, {0, 1, 1, 2}
+};
+
+// Passes 1 to n+1 together hold every pixel on a lattice with these x and y steps
+static const int adam7_lattice[7][2] = {
+    {8, 8}, {4, 8}, {4, 4}, {2, 4}, {2, 2}, {1, 2}, {1, 1}
+};
+
+static const char *adam7_methods[7] = {
+    "adam7 pass 1", "adam7 passes 1-2", "adam7 passes 1-3", "adam7 passes 1-4",
+    "adam7 passes 1-5", "adam7 passes 1-6", "adam7 passes 1-7"
+};
+
+// Gives the size of one Adam7 pass's sub-image and returns its filtered size in bytes.
+size_t adam7_pass_size(const png_decoder *png, const int pass, int *width, int *height) {
+    const int *p = adam7_passes[pass];
+    *width = png->width > p[0] ? (png->width - p[0] + p[2] - 1) / p[2] : 0;
+    *height = png->height > p[1] ? (png->height - p[1] + p[3] - 1) / p[3] : 0;
+    if(*width == 0 || *height == 0) {
+        return 0;
+    }
+    return ((size_t)*width * png->channels * (png->depth / 8) + 1) * *height;
+}
+
+// Picks the last pass needed for the lattice image to cover a grid_width x grid_height
+// grid, or -1 when it takes every pass and a normal decode is just as good.
+int adam7_last_pass(const png_decoder *png, const int grid_width, const int grid_height) {
+    for(int pass = 0; pass < 6; pass++) {
+        const int *step = adam7_lattice[pass];
+        if((png->width + step[0] - 1) / step[0] >= grid_width && (png->height + step[1] - 1) / step[1] >= grid_height) {
+            return pass;
+        }
+    }
+    return -1;
+}
+
+// Decodes an interlaced PNG from only the Adam7 passes needed for a grid_width x
+// grid_height grid, building the image of the pixels on their lattice. Inflate stops at
+// the first block boundary past the last of those passes. Returns false when every pass
+// is needed or this path does not handle the file, which then goes through the full decode.
+bool decode_png_passes(const input_file *in, const int grid_width, const int grid_height, image_data *img, decode_info *info) {
+    size_t size;
+    unsigned char *file = read_input(in, &size);
+    if(!file) {
+        return false;
+    }
+    png_decoder png;
+    bool ok = png_open(&png, file, size) && png.interlaced;
+    const int last = ok ? adam7_last_pass(&png, grid_width, grid_height) : -1;
+    ok = ok && last >= 0;
+    size_t target = 0;
+    size_t full = 0;
+    for(int pass = 0; ok && pass < 7; pass++) {
+        int pass_width, pass_height;
+        const size_t pass_size = adam7_pass_size(&png, pass, &pass_width, &pass_height);
+        target += pass <= last ? pass_size : 0;
+        full += pass_size;
+    }
+    const size_t slack = 65535 + 258;
+    ok = ok && png_begin_inflate(&png, target + slack < full ? target + slack : full) && png_inflate_to(&png, target);
+
+    const int step_x = ok ? adam7_lattice[last][0] : 1;
+    const int step_y = ok ? adam7_lattice[last][1] : 1;
+    const int width = (png.width + step_x - 1) / step_x;
+    const int height = (png.height + step_y - 1) / step_y;
+    const size_t stride = png_row_bytes(&png) + 1;
+    unsigned char *pixels = ok ? arena_malloc((size_t)width * height * png.out_channels) : NULL;
+    unsigned char *zero_row = ok ? arena_calloc(stride, 1) : NULL;
+    unsigned char *line = ok ? arena_malloc((size_t)png.width * png.out_channels) : NULL;
+    ok = ok && pixels && zero_row && line;
+    const int bpp = png.channels * (png.depth / 8);
+    unsigned char *raw = png.raw;
+    for(int pass = 0; ok && pass <= last; pass++) {
+        const int *p = adam7_passes[pass];
+        int pass_width, pass_height;
+        if(adam7_pass_size(&png, pass, &pass_width, &pass_height) == 0) {
+            continue;
+        }
+        const size_t pass_stride = (size_t)pass_width * bpp + 1;
+        for(int y = 0; ok && y < pass_height; y++) {
+            unsigned char *row = raw + y * pass_stride;
+            const unsigned char *prior = y > 0 ? row - pass_stride + 1 : zero_row;
+            ok = png_unfilter_row(row + 1, prior, pass_stride - 1, bpp, row[0]);
+            if(!ok) {
+                break;
+            }
+            // Every pixel of passes up to last lies on the lattice
+            png_expand_row(&png, row + 1, line, 0, pass_width);
+            unsigned char *dest = pixels + ((size_t)((p[1] + y * p[3]) / step_y) * width + p[0] / step_x) * png.out_channels;
+            const size_t dest_step = (size_t)(p[2] / step_x) * png.out_channels;
+            for(int x = 0; x < pass_width; x++) {
+                memcpy(dest + x * dest_step, line + (size_t)x * png.out_channels, png.out_channels);
+            }
+        }
+        raw += pass_stride * pass_height;
+    }
+    if(ok) {
+        img->data = pixels;
+        img->width = width;
+        img->height = height;
+        img->channel_count = png.out_channels;
+        info->method = adam7_methods[last];
+        info->compressed_used = png_consumed(&png);
+        info->compressed_total = png.idat_length;
+    }
+    else {
+        arena_free(pixels);
+    }
+    arena_free(line);
+    arena_free(zero_row);
+    png_close(&png);
+    release_input(in, file);
+    return ok;
+}
+
+#if defined(ASCIIGEN_THREADS)
+// Rows are handed from a separate unfilter stage in batches of this many
+#define PIPELINE_ROW_BATCH 16
+
+// Shared state of a pipelined PNG decode. One thread inflates and publishes how many
+// bytes are available, while another resizes to the first grid, pulling each source row
+// through unfiltering as stb_image_resize asks for it. With a third thread unfiltering
+// runs as its own stage, publishing rows for the resize to wait on. Stages that run
+// ahead block on the progress condition rather than spin, so the pipeline costs little
+// more than a serial decode when there are fewer cores than stages.
+typedef struct png_pipeline {
+    png_decoder png;
+    image_data *img;
+    image_data *resized;
+    pthread_mutex_t lock;
+    pthread_cond_t progress;
+    size_t inflated;
+    size_t rows_ready;
+    bool failed;
+    bool unfilter_stage;
+    int rows_unfiltered;
+    size_t available;
+    unsigned char *row_buffers;
+} png_pipeline;
+
+void pipeline_publish(png_pipeline *pipe, size_t *counter, const size_t value) {
+    pthread_mutex_lock(&pipe->lock);
+    *counter = value;
+    pthread_cond_broadcast(&pipe->progress);
+    pthread_mutex_unlock(&pipe->lock);
+}
+
+void pipeline_fail(png_pipeline *pipe) {
+    pthread_mutex_lock(&pipe->lock);
+    pipe->failed = true;
+    pthread_cond_broadcast(&pipe->progress);
+    pthread_mutex_unlock(&pipe->lock);
+}
+
+// Waits until counter reaches needed, returning its value, or 0 if another stage failed.
+size_t pipeline_wait(png_pipeline *pipe, const size_t *counter, const size_t needed) {
+    pthread_mutex_lock(&pipe->lock);
+    while(*counter < needed && !pipe->failed) {
+        pthread_cond_wait(&pipe->progress, &pipe->lock);
+    }
+    const size_t value = pipe->failed ? 0 : *counter;
+    pthread_mutex_unlock(&pipe->lock);
+    return value;
+}
+
+void pipeline_inflate(png_pipeline *pipe) {
+    png_decoder *png = &pipe->png;
+    bool ok = true;
+    // Each call inflates at least one whole block
+    while(ok && !png->finished) {
+        ok = png_inflate_to(png, png->inflated + 1) || png->finished;
+        pipeline_publish(pipe, &pipe->inflated, png->inflated);
+    }
+    if(!ok || png->inflated < (png_row_bytes(png) + 1) * png->height) {
+        pipeline_fail(pipe);
+    }
+}
+
+// Unfilters and expands rows until the first rows are done, waiting on inflate as needed.
+// Only one thread ever unfilters. Rows are unfiltered into two alternating buffers rather
+// than in place, as inflate may still copy from the filtered bytes behind it.
+bool pipeline_unfilter_to(png_pipeline *pipe, const int rows) {
+    png_decoder *png = &pipe->png;
+    const size_t stride = png_row_bytes(png) + 1;
+    const int bpp = png->channels * (png->depth / 8);
+    const size_t out_row = (size_t)png->width * png->out_channels;
+    for(int y = pipe->rows_unfiltered; y < rows; y++) {
+        if(pipe->available < stride * (y + 1)) {
+            pipe->available = pipeline_wait(pipe, &pipe->inflated, stride * (y + 1));
+            if(pipe->available == 0) {
+                return false;
+            }
+        }
+        const unsigned char *filtered = png->raw + y * stride;
+        unsigned char *row = pipe->row_buffers + (y & 1) * (stride - 1);
+        const unsigned char *prior = pipe->row_buffers + ((y + 1) & 1) * (stride - 1);
+        memcpy(row, filtered + 1, stride - 1);
+        if(!png_unfilter_row(row, prior, stride - 1, bpp, filtered[0])) {
+            pipeline_fail(pipe);
+            return false;
+        }
+        png_expand_row(png, row, pipe->img->data + y * out_row, 0, png->width);
+        pipe->rows_unfiltered = y + 1;
+        if(pipe->unfilter_stage && ((y + 1) % PIPELINE_ROW_BATCH == 0 || y + 1 == png->height)) {
+            pipeline_publish(pipe, &pipe->rows_ready, (size_t)y + 1);
+        }
+    }
+    return true;
+}
+
+// stb_image_resize's input callback, making sure row y is ready before it is read.
+const void* pipeline_row(void *optional_output, const void *input_ptr, int num_pixels, int x, int y, void *context) {
+    png_pipeline *pipe = context;
+    (void)optional_output;
+    (void)num_pixels;
+    (void)x;
+    if(pipe->unfilter_stage) {
+        pipeline_wait(pipe, &pipe->rows_ready, (size_t)y + 1);
+    }
+    else {
+        pipeline_unfilter_to(pipe, y + 1);
+    }
+    // After a failure the rows are garbage, but the result is thrown away
+    return input_ptr;
+}
+
+void pipeline_resize(png_pipeline *pipe) {
+    const image_data *img = pipe->img;
+    image_data *resized = pipe->resized;
+    STBIR_RESIZE resize;
+    stbir_resize_init(&resize, img->data, img->width, img->height, 0, resized->data, resized->width, resized->height, 0,
+                      (stbir_pixel_layout)img->channel_count, STBIR_TYPE_UINT8);
+    resize.horizontal_edge = STBIR_EDGE_CLAMP;
+    resize.vertical_edge = STBIR_EDGE_CLAMP;
+    resize.horizontal_filter = STBIR_FILTER_POINT_SAMPLE;
+    resize.vertical_filter = STBIR_FILTER_POINT_SAMPLE;
+    stbir_set_pixel_callbacks(&resize, pipeline_row, NULL);
+    stbir_set_user_data(&resize, pipe);
+    if(!kernels->resize(&resize)) {
+        pipeline_fail(pipe);
+    }
+}
+
+void png_pipeline_worker(void *ctx, int worker, int worker_count) {
+    png_pipeline *pipe = ctx;
+    (void)worker_count;
+    if(worker == 0) {
+        pipeline_inflate(pipe);
+    }
+    else if(worker == 1 && pipe->resized) {
+        pipeline_resize(pipe);
+        if(!pipe->unfilter_stage) {
+            // Rows below the last one sampled are still needed for the full image
+            pipeline_unfilter_to(pipe, pipe->img->height);
+        }
+    }
+    else {
+        pipeline_unfilter_to(pipe, pipe->img->height);
+    }
+}
+
+// Decodes a whole non-interlaced PNG with inflate, unfiltering and resizing to the first
+// grid running at the same time on up to three threads, so only the tail of each stage
+// adds to the decode time. resized gets the grid_width x grid_height image, or a NULL data
+// pointer when the grid is the image's own size. Returns false when this path does not
+// handle the file, which then goes through the full decode.
+bool decode_png_pipelined(const input_file *in, const int threads, const int grid_width, const int grid_height,
+                          image_data *img, image_data *resized, decode_info *info) {
+    size_t size;
+    unsigned char *file = read_input(in, &size);
+    if(!file) {
+        return false;
+    }
+    png_pipeline pipe;
+    memset(&pipe, 0, sizeof(pipe));
+    bool ok = png_open(&pipe.png, file, size) && !pipe.png.interlaced &&
+              png_begin_inflate(&pipe.png, (png_row_bytes(&pipe.png) + 1) * pipe.png.height);
+    img->data = ok ? arena_malloc((size_t)pipe.png.width * pipe.png.height * pipe.png.out_channels) : NULL;
+    img->width = pipe.png.width;
+    img->height = pipe.png.height;
+    img->channel_count = pipe.png.out_channels;
+    resized->data = NULL;
+    resized->width = grid_width;
+    resized->height = grid_height;
+    resized->channel_count = pipe.png.out_channels;
+    if(ok && img->data && (grid_width != img->width || grid_height != img->height)) {
+        resized->data = arena_malloc((size_t)grid_width * grid_height * resized->channel_count);
+        ok = resized->data != NULL;
+    }
+    ok = ok && img->data;
+    // The prior row of the first row is all zeros
+    pipe.row_buffers = ok ? arena_calloc(png_row_bytes(&pipe.png), 2) : NULL;
+    ok = ok && pipe.row_buffers;
+    if(ok) {
+        const int workers = resized->data ? (threads < 3 ? threads : 3) : 2;
+        pipe.img = img;
+        pipe.resized = resized->data ? resized : NULL;
+        pipe.unfilter_stage = workers == 3;
+        pthread_mutex_init(&pipe.lock, NULL);
+        pthread_cond_init(&pipe.progress, NULL);
+        run_workers(workers, png_pipeline_worker, &pipe);
+        pthread_cond_destroy(&pipe.progress);
+        pthread_mutex_destroy(&pipe.lock);
+        ok = !pipe.failed;
+    }
+    if(ok) {
+        info->method = "pipelined";
+        info->compressed_used = png_consumed(&pipe.png);
+        info->compressed_total = pipe.png.idat_length;
+    }
+    else {
+        arena_free(img->data);
+        arena_free(resized->data);
+        img->data = NULL;
+        resized->data = NULL;
+    }
+    arena_free(pipe.row_buffers);
+    png_close(&pipe.png);
+    release_input(in, file);
+    return ok;
+}
+#endif
+
+// Reads up to limit bytes from the start of in, and the file's full size into total.
+unsigned char* read_file_head(const input_file *in, const size_t limit, size_t *size, size_t *total) {
+    if(in->data) {
+        *total = in->size;
+        *size = in->size < limit ? in->size : limit;
+        unsigned char *data = malloc(*size > 0 ? *size : 1);
+        if(data) {
+            memcpy(data, in->data, *size);
+        }
+        return data;
+    }
+    FILE *f = fopen(in->name, "rb");
+    if(!f) {
+        return NULL;
+    }
+    long length = -1;
+    if(fseek(f, 0, SEEK_END) == 0) {
+        length = ftell(f);
+    }
+    unsigned char *data = NULL;
+    if(length > 0 && fseek(f, 0, SEEK_SET) == 0) {
+        *total = (size_t)length;
+        *size = *total < limit ? *total : limit;
+        data = malloc(*size);
+        if(data && fread(data, 1, *size, f) != *size) {
+            free(data);
+            data = NULL;
+        }
+    }
+    fclose(f);
+    return data;
+}
+
+// The parts of a JPEG's EXIF metadata asciigen uses, along with the start of the file
+// they were read from. Offsets are into head.
+typedef struct exif_info {
+    unsigned char *head;
+    size_t head_size;
+    size_t file_size;
+    int orientation;
+    size_t thumbnail_offset;
+    size_t thumbnail_length;
+} exif_info;
+
+// EXIF orientation tag values 1 to 8 as ORIENT_ bits
+static const int exif_orientations[8] = {
+    0, ORIENT_FLIP_X, ORIENT_FLIP_X | ORIENT_FLIP_Y, ORIENT_FLIP_Y,
+    ORIENT_TRANSPOSE, ORIENT_TRANSPOSE | ORIENT_FLIP_X, ORIENT_TRANSPOSE | ORIENT_FLIP_X | ORIENT_FLIP_Y, ORIENT_TRANSPOSE | ORIENT_FLIP_Y
+};
+
+// EXIF lives in an APP1 segment of at most 64 KB right after the start of the file.
+#define EXIF_SCAN_BYTES (128 * 1024)
+
+uint32_t tiff_read(const unsigned char *p, const int bytes, const bool big_endian) {
+    uint32_t value = 0;
+    for(int i = 0; i < bytes; i++) {
+        value = (value << 8) | p[big_endian ? i : bytes - 1 - i];
+    }
+    return value;
+}
+
+// Walks the TIFF structure inside an EXIF segment. IFD0 describes the main image and
+// IFD1, when present, the thumbnail.
+bool parse_tiff(const unsigned char *tiff, const size_t length, const size_t base, exif_info *exif) {
+    if(length < 8) {
+        return false;
+    }
+    bool big_endian;
+    if(memcmp(tiff, "MM\0*", 4) == 0) {
+        big_endian = true;
+    }
+    else if(memcmp(tiff, "II*\0", 4) == 0) {
+        big_endian = false;
+    }
+    else {
+        return false;
+    }
+    uint32_t thumbnail_offset = 0;
+    uint32_t thumbnail_length = 0;
+    uint32_t offset = tiff_read(tiff + 4, 4, big_endian);
+    for(int ifd = 0; ifd < 2 && offset != 0; ifd++) {
+        if(offset > length - 2) {
+            return false;
+        }
+        const uint32_t count = tiff_read(tiff + offset, 2, big_endian);
+        if((size_t)count * 12 + 6 > length - offset) {
+            return false;
+        }
+        for(uint32_t i = 0; i < count; i++) {
+            const unsigned char *entry = tiff + offset + 2 + i * 12;
+            const uint32_t tag = tiff_read(entry, 2, big_endian);
+            // SHORT values sit in the first two bytes of the value field, LONG values fill it
+            const uint32_t value = tiff_read(entry + 8, tiff_read(entry + 2, 2, big_endian) == 3 ? 2 : 4, big_endian);
+            if(ifd == 0 && tag == 0x0112 && value >= 1 && value <= 8) {
+                exif->orientation = exif_orientations[value - 1];
+            }
+            else if(ifd == 1 && tag == 0x0201) {
+                thumbnail_offset = value;
+            }
+            else if(ifd == 1 && tag == 0x0202) {
+                thumbnail_length = value;
+            }
+        }
+        offset = tiff_read(tiff + offset + 2 + count * 12, 4, big_endian);
+    }
+    if(thumbnail_length > 0 && thumbnail_offset <= length && thumbnail_length <= length - thumbnail_offset) {
+        exif->thumbnail_offset = base + thumbnail_offset;
+        exif->thumbnail_length = thumbnail_length;
+    }
+    return true;
+}
+
+// Finds the EXIF APP1 segment among the JPEG markers before the image data and parses it.
+bool parse_exif(const unsigned char *data, const size_t size, exif_info *exif) {
+    if(size < 4 || data[0] != 0xFF || data[1] != 0xD8) {
+        return false;
+    }
+    size_t pos = 2;
+    while(pos + 4 <= size) {
+        if(data[pos] != 0xFF) {
+            return false;
+        }
+        const int marker = data[pos + 1];
+        if(marker == 0xFF) {
+            pos++;
+            continue;
+        }
+        if(marker == 0xDA || marker == 0xD9) {
+            return false;
+        }
+        const size_t length = ((size_t)data[pos + 2] << 8) | data[pos + 3];
+        if(length < 2) {
+            return false;
+        }
+        if(marker == 0xE1 && length >= 16 && pos + 2 + length <= size && memcmp(data + pos + 4, "Exif\0\0", 6) == 0) {
+            return parse_tiff(data + pos + 10, length - 8, pos + 10, exif);
+        }
+        pos += 2 + length;
+    }
+    return false;
+}
+
+// Reads the start of in and parses its EXIF metadata, if it has any.
+bool read_exif(const input_file *in, exif_info *exif) {
+    memset(exif, 0, sizeof(*exif));
+    exif->head = read_file_head(in, EXIF_SCAN_BYTES, &exif->head_size, &exif->file_size);
+    return exif->head && parse_exif(exif->head, exif->head_size, exif);
+}
+
+void exif_close(exif_info *exif) {
+    free(exif->head);
+    exif->head = NULL;
+}
+
+// Looks for an EXIF thumbnail that can stand in for the full width x height image when
+// rendering a grid_width x grid_height grid: it has to cover the grid in both directions
+// and have the image's aspect ratio, as some cameras letterbox their thumbnails.
+bool find_thumbnail(const exif_info *exif, const int width, const int height, const int grid_width, const int grid_height, image_data *thumb) {
+    if(exif->thumbnail_length == 0 ||
+       !stbi_info_from_memory(exif->head + exif->thumbnail_offset, (int)exif->thumbnail_length, &thumb->width, &thumb->height, &thumb->channel_count)) {
+        return false;
+    }
+    const long long skew = (long long)thumb->width * height - (long long)thumb->height * width;
+    return thumb->width >= grid_width && thumb->height >= grid_height && thumb->width <= width &&
+           (skew < 0 ? -skew : skew) * 50 <= (long long)thumb->width * height;
+}
+
+// Decodes the EXIF thumbnail in place of the full width x height image, if find_thumbnail
+// accepts it for the grid.
+bool decode_thumbnail(const exif_info *exif, const int width, const int height, const int grid_width, const int grid_height,
+                      image_data *img, decode_info *info) {
+    image_data thumb;
+    if(!find_thumbnail(exif, width, height, grid_width, grid_height, &thumb)) {
+        return false;
+    }
+    thumb.data = stbi_load_from_memory(exif->head + exif->thumbnail_offset, (int)exif->thumbnail_length,
+                                       &thumb.width, &thumb.height, &thumb.channel_count, 0);
+    if(!thumb.data) {
+        return false;
+    }
+    thumb.stride = 0;
+    *img = thumb;
+    info->method = "thumbnail";
+    info->compressed_used = exif->thumbnail_length;
+    info->compressed_total = exif->file_size;
+    return true;
+}
+
+// Walks a JPEG's markers up to the start of its image data and reports whether it is a
+// single scan baseline image with restart markers, whose entropy-coded segments can then
+// be decoded independently. Only data up to the first scan is needed.
+bool jpeg_has_restarts(const unsigned char *data, const size_t size) {
+    if(size < 4 || data[0] != 0xFF || data[1] != 0xD8) {
+        return false;
+    }
+    int components = 0;
+    int restart_interval = 0;
+    size_t pos = 2;
+    while(pos + 4 <= size) {
+        if(data[pos] != 0xFF) {
+            return false;
+        }
+        const int marker = data[pos + 1];
+        if(marker == 0xFF) {
+            pos++;
+            continue;
+        }
+        const size_t length = ((size_t)data[pos + 2] << 8) | data[pos + 3];
+        if(length < 2 || pos + 2 + length > size || marker == 0xD9) {
+            return false;
+        }
+        if(marker == 0xC0 || marker == 0xC1) {
+            if(length < 8) {
+                return false;
+            }
+            components = data[pos + 9];
+        }
+        else if(marker >= 0xC2 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC) {
+            // Progressive, lossless and arithmetic coded frames
+            return false;
+        }
+        else if(marker == 0xDD && length == 4) {
+            restart_interval = (data[pos + 4] << 8) | data[pos + 5];
+        }
+        else if(marker == 0xDA) {
+            // Every component has to be in the one scan
+            return restart_interval > 0 && (components == 1 || components == 3) && length >= 3 && data[pos + 4] == components;
+        }
+        pos += 2 + length;
+    }
+    return false;
+}
+
+bool jpeg_restarts(const input_file *in) {
+    size_t size, total;
+    unsigned char *head = read_file_head(in, EXIF_SCAN_BYTES, &size, &total);
+    const bool restarts = head && jpeg_has_restarts(head, size);
+    free(head);
+    return restarts;
+}
+
+#if defined(ASCIIGEN_THREADS)
+// A baseline JPEG decoded with stb_image's own huffman decoding, IDCT and color
+// conversion, but with the entropy-coded data split at its restart markers so the
+// segments decode on separate threads. Each worker owns a copy of the decoder state
+// and writes the blocks of its own segments into the shared component planes.
+typedef struct jpeg_restart_decode {
+    stbi__jpeg *jpeg;
+    const unsigned char *scan;
+    size_t *starts;
+    int segments;
+    int mcus;
+    image_data *img;
+    bool failed;
+} jpeg_restart_decode;
+
+// Splits the entropy-coded data at its RSTn markers, storing where each segment starts
+// and, last, where the data ends. Returns the number of segments, or 0 if there is no room.
+int jpeg_split_segments(const unsigned char *scan, const size_t size, size_t *starts, const int capacity) {
+    int count = 0;
+    starts[count++] = 0;
+    size_t pos = 0;
+    for(;;) {
+        const unsigned char *marker = memchr(scan + pos, 0xFF, size - pos);
+        if(!marker) {
+            pos = size;
+            break;
+        }
+        pos = (size_t)(marker - scan) + 1;
+        while(pos < size && scan[pos] == 0xFF) {
+            pos++;
+        }
+        if(pos == size || scan[pos] == 0x00) {
+            continue;
+        }
+        if(scan[pos] < 0xD0 || scan[pos] > 0xD7) {
+            pos = (size_t)(marker - scan);
+            break;
+        }
+        if(count == capacity) {
+            return 0;
+        }
+        starts[count++] = ++pos;
+    }
+    starts[count] = pos;
+    return count;
+}
+
+// Decodes MCUs first to last of the scan, a scan of a single component having one
+// block per MCU, the way stb_image does.
+bool jpeg_decode_mcus(stbi__jpeg *z, const int first, const int last) {
+    STBI_SIMD_ALIGN(short, data[64]);
+    for(int mcu = first; mcu < last; mcu++) {
+        for(int k = 0; k < z->scan_n; k++) {
+            const int n = z->order[k];
+            const int h = z->scan_n == 1 ? 1 : z->img_comp[n].h;
+            const int v = z->scan_n == 1 ? 1 : z->img_comp[n].v;
+            const int mcus_x = z->scan_n == 1 ? (z->img_comp[n].x + 7) >> 3 : z->img_mcu_x;
+            const int ha = z->img_comp[n].ha;
+            for(int y = 0; y < v; y++) {
+                for(int x = 0; x < h; x++) {
+                    const int x2 = ((mcu % mcus_x) * h + x) * 8;
+                    const int y2 = ((mcu / mcus_x) * v + y) * 8;
+                    if(!stbi__jpeg_decode_block(z, data, z->huff_dc + z->img_comp[n].hd, z->huff_ac + ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) {
+                        return false;
+                    }
+                    z->idct_block_kernel(z->img_comp[n].data + z->img_comp[n].w2 * y2 + x2, z->img_comp[n].w2, data);
+                }
+            }
+        }
+    }
+    return true;
+}
+
+void jpeg_segment_worker(void *ctx, int worker, int worker_count) {
+    jpeg_restart_decode *dec = ctx;
+    stbi__jpeg *z = malloc(sizeof(stbi__jpeg));
+    if(!z) {
+        __atomic_store_n(&dec->failed, true, __ATOMIC_RELAXED);
+        return;
+    }
+    // The copy shares the tables and component planes but has its own bit reader
+    stbi__context s = {0};
+    *z = *dec->jpeg;
+    z->s = &s;
+    const int interval = dec->jpeg->restart_interval;
+    const int first = (int)((long long)dec->segments * worker / worker_count);
+    const int last = (int)((long long)dec->segments * (worker + 1) / worker_count);
+    for(int i = first; i < last; i++) {
+        const int mcu_end = (i + 1) * interval < dec->mcus ? (i + 1) * interval : dec->mcus;
+        stbi__start_mem(&s, dec->scan + dec->starts[i], (int)(dec->starts[i + 1] - dec->starts[i]));
+        stbi__jpeg_reset(z);
+        if(!jpeg_decode_mcus(z, i * interval, mcu_end)) {
+            __atomic_store_n(&dec->failed, true, __ATOMIC_RELAXED);
+            break;
+        }
+    }
+    free(z);
+}
+
+// Upsamples and color converts a band of rows, following load_jpeg_image. The resampler
+// state at the band's first row is worked out by stepping through the rows above it.
+void jpeg_convert_worker(void *ctx, int worker, int worker_count) {
+    jpeg_restart_decode *dec = ctx;
+    stbi__jpeg *z = dec->jpeg;
+    const int components = z->s->img_n;
+    const int width = dec->img->width;
+    const int first = (int)((long long)dec->img->height * worker / worker_count);
+    const int last = (int)((long long)dec->img->height * (worker + 1) / worker_count);
+    const bool is_rgb = components == 3 && (z->rgb == 3 || (z->app14_color_transform == 0 && !z->jfif));
+    stbi__resample res_comp[3];
+    stbi_uc *line_buffers = malloc((size_t)(width + 3) * components + (size_t)width * 3 + 1);
+    if(!line_buffers) {
+        __atomic_store_n(&dec->failed, true, __ATOMIC_RELAXED);
+        return;
+    }
+    for(int k = 0; k < components; k++) {
+        stbi__resample *r = &res_comp[k];
+        r->hs = z->img_h_max / z->img_comp[k].h;
+        r->vs = z->img_v_max / z->img_comp[k].v;
+        r->ystep = r->vs >> 1;
+        r->w_lores = (width + r->hs - 1) / r->hs;
+        r->ypos = 0;
+        r->line0 = r->line1 = z->img_comp[k].data;
+        if(r->hs == 1 && r->vs == 1) r->resample = resample_row_1;
+        else if(r->hs == 1 && r->vs == 2) r->resample = stbi__resample_row_v_2;
+        else if(r->hs == 2 && r->vs == 1) r->resample = stbi__resample_row_h_2;
+        else if(r->hs == 2 && r->vs == 2) r->resample = z->resample_row_hv_2_kernel;
+        else r->resample = stbi__resample_row_generic;
+    }
+    for(int y = 0; y < last; y++) {
+        stbi_uc *coutput[3];
+        for(int k = 0; k < components; k++) {
+            stbi__resample *r = &res_comp[k];
+            if(y >= first) {
+                const bool y_bot = r->ystep >= (r->vs >> 1);
+                coutput[k] = r->resample(line_buffers + (size_t)(width + 3) * k, y_bot ? r->line1 : r->line0, y_bot ? r->line0 : r->line1, r->w_lores, r->hs);
+            }
+            if(++r->ystep >= r->vs) {
+                r->ystep = 0;
+                r->line0 = r->line1;
+                if(++r->ypos < z->img_comp[k].y) {
+                    r->line1 += z->img_comp[k].w2;
+                }
+            }
+        }
+        if(y < first) {
+            continue;
+        }
+        stbi_uc *out = dec->img->data + (size_t)width * components * y;
+        if(components == 1) {
+            memcpy(out, coutput[0], width);
+        }
+        else if(is_rgb) {
+            for(int x = 0; x < width; x++) {
+                out[x * 3] = coutput[0][x];
+                out[x * 3 + 1] = coutput[1][x];
+                out[x * 3 + 2] = coutput[2][x];
+            }
+        }
+        else if(y < last - 1) {
+            z->YCbCr_to_RGB_kernel(out, coutput[0], coutput[1], coutput[2], width, 3);
+        }
+        else {
+            // The conversion writes a byte past each pixel, which for the band's last row
+            // would land on the next band, so that row goes through a spare row first
+            stbi_uc *spare = line_buffers + (size_t)(width + 3) * components;
+            z->YCbCr_to_RGB_kernel(spare, coutput[0], coutput[1], coutput[2], width, 3);
+            memcpy(out, spare, (size_t)width * 3);
+        }
+    }
+    free(line_buffers);
+}
+
+// Decodes a baseline JPEG with restart markers on up to threads threads: the segments
+// between markers are decoded in parallel, then bands of rows are color converted in
+// parallel. Returns false for anything else, including progressive JPEGs and files whose
+// markers don't match their restart interval, which then go through stbi_load.
+bool decode_jpeg_restarts(const input_file *in, const int threads, image_data *img, decode_info *info) {
+    size_t size;
+    unsigned char *file = read_input(in, &size);
+    stbi__jpeg *z = arena_calloc(1, sizeof(stbi__jpeg));
+    if(!file || !z || size > INT_MAX) {
+        release_input(in, file);
+        arena_free(z);
+        return false;
+    }
+    stbi__context s = {0};
+    stbi__start_mem(&s, file, (int)size);
+    z->s = &s;
+    stbi__setup_jpeg(z);
+    bool ok = stbi__decode_jpeg_header(z, STBI__SCAN_load);
+    int marker = ok ? stbi__get_marker(z) : STBI__MARKER_none;
+    while(ok && !stbi__SOS(marker)) {
+        ok = !stbi__EOI(marker) && stbi__process_marker(z, marker);
+        marker = stbi__get_marker(z);
+    }
+    ok = ok && stbi__process_scan_header(z) && !z->progressive && z->restart_interval > 0 &&
+         (s.img_n == 1 || s.img_n == 3) && z->scan_n == s.img_n;
+    jpeg_restart_decode dec;
+    memset(&dec, 0, sizeof(dec));
+    if(ok) {
+        const int n = z->order[0];
+        dec.jpeg = z;
+        dec.scan = s.img_buffer;
+        dec.mcus = z->scan_n == 1 ? ((z->img_comp[n].x + 7) >> 3) * ((z->img_comp[n].y + 7) >> 3) : z->img_mcu_x * z->img_mcu_y;
+        const int expected = (dec.mcus + z->restart_interval - 1) / z->restart_interval;
+        dec.starts = arena_malloc(sizeof(size_t) * (expected + 1));
+        dec.segments = dec.starts ? jpeg_split_segments(dec.scan, (size_t)(s.img_buffer_end - s.img_buffer), dec.starts, expected) : 0;
+        ok = dec.segments == expected;
+    }
+    if(ok) {
+        img->width = (int)s.img_x;
+        img->height = (int)s.img_y;
+        img->channel_count = s.img_n;
+        img->data = arena_malloc((size_t)img->width * img->height * img->channel_count);
+        dec.img = img;
+        ok = img->data != NULL;
+    }
+    if(ok) {
+        const int segment_workers = threads < dec.segments ? threads : dec.segments;
+        run_workers(segment_workers, jpeg_segment_worker, &dec);
+        if(!dec.failed) {
+            run_workers(threads < img->height ? threads : img->height, jpeg_convert_worker, &dec);
+        }
+        ok = !dec.failed;
+        if(!ok) {
+            arena_free(img->data);
+            img->data = NULL;
+        }
+    }
+    if(ok) {
+        info->method = "restart segments";
+    }
+    stbi__cleanup_jpeg(z);
+    arena_free(dec.starts);
+    arena_free(z);
+    release_input(in, file);
+    return ok;
+}
+#endif
+
+void terminal_size(int *columns, int *rows) {
+#if !defined(_WIN32)
+    const int fds[3] = {STDOUT_FILENO, STDERR_FILENO, STDIN_FILENO};
+    for(int i = 0; i < 3; i++) {
+        struct winsize ws;
+        if(ioctl(fds[i], TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0 && ws.ws_row > 0) {
+            *columns = ws.ws_col;
+            *rows = ws.ws_row;
+            return;
+        }
+    }
+#else
+    CONSOLE_SCREEN_BUFFER_INFO info;
+    if(GetConsoleScreenBufferInfo(GetStdHandle(STD_OUTPUT_HANDLE), &info)) {
+        *columns = info.srWindow.Right - info.srWindow.Left + 1;
+        *rows = info.srWindow.Bottom - info.srWindow.Top + 1;
+        return;
+    }
+#endif
+    const char *env_columns = getenv("COLUMNS");
+    const char *env_rows = getenv("LINES");
+    *columns = env_columns && atoi(env_columns) > 0 ? atoi(env_columns) : 80;
+    *rows = env_rows && atoi(env_rows) > 0 ? atoi(env_rows) : 24;
+}
+
+bool fit_requested(const config *conf) {
+    return conf->fit || conf->columns > 0 || conf->rows > 0;
+}
+
+// The bounds on the output given by --cols and --rows, 0 when unbounded. --fit takes any
+// missing bound from the terminal, leaving a line for the prompt.
+void grid_bounds(const config *conf, int *max_columns, int *max_rows) {
+    *max_columns = conf->columns;
+    *max_rows = conf->rows;
+    if(conf->fit) {
+        int term_columns, term_rows;
+        terminal_size(&term_columns, &term_rows);
+        if(*max_columns <= 0) {
+            *max_columns = term_columns;
+        }
+        if(*max_rows <= 0) {
+            *max_rows = term_rows > 1 ? term_rows - 1 : 1;
+        }
+    }
+}
+
+// Computes the output grid for a source of the given size. The grid is kept within
+// grid_bounds, with the aspect ratio kept with characters assumed to be CHAR_ASPECT times
+// taller than wide.
+void output_grid(const config *conf, const int src_width, const int src_height, int *width, int *height) {
+    if(!fit_requested(conf)) {
+        *width = (int)(src_width * conf->w_scaling);
+        *height = (int)(src_height * conf->h_scaling);
+        return;
+    }
+    int max_columns, max_rows;
+    grid_bounds(conf, &max_columns, &max_rows);
+    double scale = -1.0;
+    if(max_columns > 0) {
+        scale = (double)max_columns / src_width;
+    }
+    if(max_rows > 0) {
+        const double row_scale = max_rows * CHAR_ASPECT / src_height;
+        if(scale < 0.0 || row_scale < scale) {
+            scale = row_scale;
+        }
+    }
+    *width = (int)(src_width * scale + 0.5);
+    *height = (int)(src_height * scale / CHAR_ASPECT + 0.5);
+    if(max_columns > 0 && *width > max_columns) {
+        *width = max_columns;
+    }
+    if(max_rows > 0 && *height > max_rows) {
+        *height = max_rows;
+    }
+    *width = *width < 1 ? 1 : *width;
+    *height = *height < 1 ? 1 : *height;
+}
+
+// Computes the grid of every requested size for a source of the given stored size,
+// returning how many there are. Fitting always produces a single size. Grids are sized
+// for the image as conf->orientation shows it, but returned in stored orientation since
+// that is the orientation they are resized in.
+int variant_grids(const config *conf, const int src_width, const int src_height, int *widths, int *heights) {
+    const int count = fit_requested(conf) ? 1 : conf->variant_count;
+    const bool transpose = conf->orientation & ORIENT_TRANSPOSE;
+    for(int i = 0; i < count; i++) {
+        config variant_conf = *conf;
+        variant_conf.w_scaling = conf->w_scales[i];
+        variant_conf.h_scaling = conf->h_scales[i];
+        if(transpose) {
+            output_grid(&variant_conf, src_height, src_width, &heights[i], &widths[i]);
+        }
+        else {
+            output_grid(&variant_conf, src_width, src_height, &widths[i], &heights[i]);
+        }
+    }
+    return count;
+}
+
+// The smallest source that still covers every grid, which is what a thumbnail has to be.
+void largest_grid(const int *widths, const int *heights, const int count, int *width, int *height) {
+    *width = 0;
+    *height = 0;
+    for(int i = 0; i < count; i++) {
+        *width = widths[i] > *width ? widths[i] : *width;
+        *height = heights[i] > *height ? heights[i] : *height;
+    }
+}
+
+char* str_dup(const char *s) {
+    if(s == NULL) {
+        return NULL;
+    }
+    size_t size = strlen(s) + 1;
+    char *new_str = malloc(size);
+    if(new_str == NULL) {
+        return NULL;
+    }
+    strncpy(new_str, s, size);
+    return new_str;
+}
+
+void default_config(config *conf) {
+    conf->filenames = NULL;
+    conf->file_count = 0;
+    conf->character_set = str_dup("@%#*+=-:. ");
+    conf->invert = false;
+    conf->character_sets[0] = conf->character_set;
+    conf->character_set_count = 1;
+    conf->style_sets[0] = conf->character_set;
+    conf->style_inverts[0] = false;
+    conf->style_count = 1;
+    conf->h_scaling = -1.0;
+    conf->w_scaling = -1.0;
+    conf->scaling = 1.0;
+    conf->w_scales[0] = 1.0;
+    conf->h_scales[0] = 1.0;
+    conf->variant_count = 1;
+    conf->dither = DITHER_NONE;
+    conf->threads = 1;
+    conf->stats = false;
+    conf->fit = false;
+    conf->columns = 0;
+    conf->rows = 0;
+    conf->plan = false;
+    conf->output_path = NULL;
+    conf->format = FORMAT_TEXT;
+    conf->crop.x = 0;
+    conf->crop.y = 0;
+    conf->crop.width = 0;
+    conf->crop.height = 0;
+    conf->prefer_thumbnail = false;
+    conf->orientation = 0;
+    conf->exif_orientation = true;
+    conf->prefetch = 0;
+    conf->shard = 0;
+    conf->shard_count = 1;
+    conf->manifest_path = NULL;
+    conf->montage_columns = 0;
+    conf->montage_rows = 0;
+    conf->captions = false;
+    conf->edges = false;
+    conf->tone = TONE_NONE;
+    conf->save_lum_path = NULL;
+    conf->from_lum = false;
+    conf->cpu_level = detect_cpu_level();
+    conf->huge_pages = false;
+    conf->stream_width = 0;
+    conf->stream_height = 0;
+    conf->stream_channels = 3;
+    conf->max_latency = 0.0;
+    conf->cache_frames = true;
+    conf->frame_tolerance = 0;
+}
+
+crop_rect parse_crop(const char *value) {
+    crop_rect crop;
+    char *end;
+    long parts[4];
+    const char *itr = value;
+    for(int i = 0; i < 4; i++) {
+        parts[i] = strtol(itr, &end, 10);
+        if(end == itr || (i < 3 && *end != ',') || (i == 3 && *end != '\0') || parts[i] < 0 || parts[i] > STBI_MAX_DIMENSIONS) {
+            fprintf(stderr, "Invalid crop \"%s\". Expected x,y,width,height in pixels.\n", value);
+            exit(1);
+        }
+        itr = end + 1;
+    }
+    if(parts[2] == 0 || parts[3] == 0) {
+        fprintf(stderr, "Invalid crop \"%s\". Width and height must be greater than 0.\n", value);
+        exit(1);
+    }
+    crop.x = (int)parts[0];
+    crop.y = (int)parts[1];
+    crop.width = (int)parts[2];
+    crop.height = (int)parts[3];
+    return crop;
+}
+
+// Clockwise rotations as ORIENT_ bits
+int parse_rotation(const char *value) {
+    if(strcmp(value, "0") == 0) {
+        return 0;
+    }
+    if(strcmp(value, "90") == 0) {
+        return ORIENT_TRANSPOSE | ORIENT_FLIP_X;
+    }
+    if(strcmp(value, "180") == 0) {
+        return ORIENT_FLIP_X | ORIENT_FLIP_Y;
+    }
+    if(strcmp(value, "270") == 0) {
+        return ORIENT_TRANSPOSE | ORIENT_FLIP_Y;
+    }
+    fprintf(stderr, "Invalid rotation \"%s\". Expected 90, 180 or 270 degrees clockwise.\n", value);
+    exit(1);
+}
+
+int parse_flip(const char *value) {
+    if(strcmp(value, "h") == 0) {
+        return ORIENT_FLIP_X;
+    }
+    if(strcmp(value, "v") == 0) {
+        return ORIENT_FLIP_Y;
+    }
+    if(strcmp(value, "hv") == 0 || strcmp(value, "vh") == 0) {
+        return ORIENT_FLIP_X | ORIENT_FLIP_Y;
+    }
+    if(strcmp(value, "transpose") == 0) {
+        return ORIENT_TRANSPOSE;
+    }
+    fprintf(stderr, "Invalid flip \"%s\". Expected h, v, hv or transpose.\n", value);
+    exit(1);
+}
+
+output_format parse_format(const char *name) {
+    if(strcmp(name, "text") == 0) {
+        return FORMAT_TEXT;
+    }
+    if(strcmp(name, "html") == 0) {
+        return FORMAT_HTML;
+    }
+    if(strcmp(name, "svg") == 0) {
+        return FORMAT_SVG;
+    }
+    fprintf(stderr, "Unknown output format \"%s\". Expected text, html or svg.\n", name);
+    exit(1);
+}
+
+dither_mode parse_dither(const char *name) {
+    if(strcmp(name, "none") == 0) {
+        return DITHER_NONE;
+    }
+    if(strcmp(name, "floyd") == 0) {
+        return DITHER_FLOYD;
+    }
+    if(strcmp(name, "atkinson") == 0) {
+        return DITHER_ATKINSON;
+    }
+    if(strcmp(name, "bayer4") == 0) {
+        return DITHER_BAYER4;
+    }
+    if(strcmp(name, "bayer8") == 0) {
+        return DITHER_BAYER8;
+    }
+    fprintf(stderr, "Unknown dither mode \"%s\". Expected floyd, atkinson, bayer4 or bayer8.\n", name);
+    exit(1);
+}
+
+const char* dither_name(const dither_mode mode) {
+    switch(mode) {
+        case DITHER_FLOYD:
+            return "floyd";
+        case DITHER_ATKINSON:
+            return "atkinson";
+        case DITHER_BAYER4:
+            return "bayer4";
+        case DITHER_BAYER8:
+            return "bayer8";
+        case DITHER_NONE:
+            break;
+    }
+    return "none";
+}
+
+// Parses a comma separated list of scaling factors into scales, returning how many there were.
+int parse_scales(const char *value, double *scales) {
+    int count = 0;
+    const char *itr = value;
+    for(;;) {
+        if(count == MAX_VARIANTS) {
+            fprintf(stderr, "Too many scaling factors in \"%s\". At most %d can be given.\n", value, MAX_VARIANTS);
+            exit(1);
+        }
+        char *end;
+        scales[count++] = strtod(itr, &end);
+        if(*end != ',') {
+            break;
+        }
+        itr = end + 1;
+    }
+    return count;
+}
+
+int parse_count(const char *option, const char *value) {
+    const long count = strtol(value, NULL, 10);
+    if(count <= 0 || count > 1000000) {
+        fprintf(stderr, "Invalid value \"%s\" for %s. Expected a positive whole number.\n", value, option);
+        exit(1);
+    }
+    return (int)count;
+}
+
+void parse_shard(const char *value, config *conf) {
+    char *end;
+    const long shard = strtol(value, &end, 10);
+    const long count = *end == '/' ? strtol(end + 1, &end, 10) : 0;
+    if(*end != '\0' || count < 1 || count > 1000000 || shard < 0 || shard >= count) {
+        fprintf(stderr, "Invalid shard \"%s\". Expected i/N with i from 0 to N-1.\n", value);
+        exit(1);
+    }
+    conf->shard = (int)shard;
+    conf->shard_count = (int)count;
+}
+
+void parse_montage(const char *value, config *conf) {
+    char *end;
+    const long columns = strtol(value, &end, 10);
+    const long rows = *end == 'x' ? strtol(end + 1, &end, 10) : 0;
+    if(*end != '\0' || columns < 1 || columns > 1000 || rows < 1 || rows > 1000) {
+        fprintf(stderr, "Invalid montage \"%s\". Expected COLSxROWS, e.g. 4x3.\n", value);
+        exit(1);
+    }
+    conf->montage_columns = (int)columns;
+    conf->montage_rows = (int)rows;
+}
+
+// Raw frame size as WxH or WxHxC, C being 1 (gray), 2 (gray and alpha), 3 (RGB, the
+// default) or 4 (RGBA)
+void parse_stream(const char *value, config *conf) {
+    char *end;
+    const long width = strtol(value, &end, 10);
+    const long height = *end == 'x' ? strtol(end + 1, &end, 10) : 0;
+    const long channels = *end == 'x' ? strtol(end + 1, &end, 10) : 3;
+    if(*end != '\0' || width < 1 || width > STBI_MAX_DIMENSIONS || height < 1 || height > STBI_MAX_DIMENSIONS ||
+       channels < 1 || channels > 4) {
+        fprintf(stderr, "Invalid stream frame size \"%s\". Expected WIDTHxHEIGHT or WIDTHxHEIGHTxCHANNELS, e.g. 640x480x3.\n", value);
+        exit(1);
+    }
+    conf->stream_width = (int)width;
+    conf->stream_height = (int)height;
+    conf->stream_channels = (int)channels;
+}
+
+double parse_latency(const char *value) {
+    char *end;
+    const double ms = strtod(value, &end);
+    if(end == value || *end != '\0' || !(ms > 0.0)) {
+        fprintf(stderr, "Invalid latency \"%s\". Expected milliseconds greater than 0.\n", value);
+        exit(1);
+    }
+    return ms;
+}
+
+int parse_tolerance(const char *value) {
+    char *end;
+    const long tolerance = strtol(value, &end, 10);
+    if(end == value || *end != '\0' || tolerance < 0 || tolerance > 255) {
+        fprintf(stderr, "Invalid frame tolerance \"%s\". Expected a whole number from 0 to 255.\n", value);
+        exit(1);
+    }
+    return (int)tolerance;
+}
+
+int parse_threads(const char *value) {
+    const long threads = strtol(value, NULL, 10);
+    if(threads < 0) {
+        fputs("Invalid thread count. Use 0 for one thread per CPU.\n", stderr);
+        exit(1);
+    }
+    if(threads == 0) {
+#if defined(ASCIIGEN_THREADS)
+        const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        return cpus > 0 ? (int)cpus : 1;
+#else
+        return 1;
+#endif
+    }
+    return threads > 256 ? 256 : (int)threads;
+}
+
+// Picks the kernels named by --cpu-level, which the CPU has to support
+cpu_level parse_cpu_level(const char *name) {
+    for(int level = 0; level < CPU_LEVEL_COUNT; level++) {
+        if(strcmp(name, cpu_level_names[level]) != 0) {
+            continue;
+        }
+        if(level > (int)detect_cpu_level()) {
+            fprintf(stderr, "The %s kernels can't run on this CPU. See --cpu-features.\n", name);
+            exit(1);
+        }
+        return (cpu_level)level;
+    }
+    fprintf(stderr, "Unknown CPU level \"%s\". Use %s, %s or %s.\n", name, cpu_level_names[CPU_BASELINE],
+            cpu_level_names[CPU_AVX2], cpu_level_names[CPU_AVX512]);
+    exit(1);
+}
+
+void print_cpu_feature(const char *name, const bool supported) {
+    if(supported) {
+        printf(" %s", name);
+    }
+}
+
+void print_cpu_features(void) {
+    const cpu_level best = detect_cpu_level();
+    printf("features:");
+#if defined(ASCIIGEN_CPU_DISPATCH)
+    print_cpu_feature("sse2", __builtin_cpu_supports("sse2"));
+    print_cpu_feature("sse4.2", __builtin_cpu_supports("sse4.2"));
+    print_cpu_feature("avx", __builtin_cpu_supports("avx"));
+    print_cpu_feature("avx2", __builtin_cpu_supports("avx2"));
+    print_cpu_feature("fma", __builtin_cpu_supports("fma"));
+    print_cpu_feature("avx512f", __builtin_cpu_supports("avx512f"));
+    print_cpu_feature("avx512bw", __builtin_cpu_supports("avx512bw"));
+#else
+    print_cpu_feature("none detected", true);
+#endif
+    printf("\nlevels:  ");
+    for(int level = 0; level <= (int)best; level++) {
+        printf(" %s", cpu_level_names[level]);
+    }
+    printf("\nselected: %s (resize %s)\n", cpu_level_names[best], kernel_levels[best].resize_name);
+}
+
+void print_version(void) {
+    printf("asciigen - v%s\n", VERSION);
+}
+
+void print_help(void) {
+    puts("Usage:\n       asciigen [options] image.png [more images...]\n       asciigen [options] --stream WxH[xC] < frames");
+    puts("Options:");
+    puts("  -i              inverts light and dark colors. Brightest pixels use densest characters. -ii renders both");
+    puts("  -w scale        Width scaling factor. Output's width will be original_width * scale");
+    puts("  -h scale        Height scaling factor. Output's height will be original_height * scale");
+    puts("  -s scale        Even scaling factor. Output's dimensions will be original * scale");
+    puts("  -c \"chars\"      Custom character set chars will be used rather than the default of \"@%#*+=-:. \". Repeat for more styles");
+    puts("  -o path         Writes the art to a file instead of printing it");
+    puts("  --format type   Output format: text (default), or colored html or svg");
+    puts("  --dither mode   Dither brightness across the character set: floyd, atkinson, bayer4 or bayer8");
+    puts("  --edges         Draws strong edges with directional characters (| / - \\ _) over the brightness");
+    puts("  --auto-contrast Stretches the image's brightness range over the whole character set");
+    puts("  --equalize      Spreads the image's brightness levels evenly over the character set");
+    puts("  --crop x,y,w,h  Renders only the given region of the image, in source pixels");
+    puts("  --prefer-thumbnail  Decodes a JPEG's embedded EXIF thumbnail instead when it is large enough");
+    puts("  --rotate deg    Rotates the output clockwise by 90, 180 or 270 degrees");
+    puts("  --flip axis     Mirrors the output: h (left to right), v (top to bottom), hv or transpose");
+    puts("  --ignore-orientation  Ignores the EXIF orientation of JPEGs instead of applying it");
+    puts("  --fit           Fit the output to the terminal, keeping the image's aspect ratio");
+    puts("  --cols n        Fit the output within n columns, keeping the image's aspect ratio");
+    puts("  --rows n        Fit the output within n rows, keeping the image's aspect ratio");
+    puts("  --montage CxR   Renders the images together as a grid of C columns and R rows of tiles");
+    puts("  --captions      Writes each image's file name under its tile in a montage");
+    puts("  --save-lum file Also saves the brightness (and color) of every character cell to file");
+    puts("  --from-lum      Renders grids saved with --save-lum instead of images, skipping decode and resize");
+    puts("  --stream WxH[xC]  Renders raw frames of W by H pixels and C channels (default 3) read from stdin, one after another");
+    puts("  --max-latency ms  Drops stream frames that would be written more than ms after they were read");
+    puts("  --frame-tolerance n  Keeps a stream cell's character while its pixel changes by at most n per channel, rendering on one thread. Defaults to 0");
+    puts("  --no-frame-cache  Maps every cell of every stream frame, rather than only the cells that changed");
+    puts("  --plan          Prints the planned work for each image from its header, without decoding it");
+    puts("  --threads n     Number of worker threads, 0 for one per CPU. Defaults to 1");
+    puts("  --prefetch n    Reads up to n images ahead of the one being rendered");
+    puts("  --shard i/N     Renders only the images whose path hashes to shard i of N (0 to N-1)");
+    puts("  --manifest file Records each rendered image in file, and skips those it already records");
+    puts("  --stats         Prints timing of each stage to stderr");
+    puts("  --huge-pages    Backs the memory images are decoded and resized in with huge pages, where supported");
+    puts("  --cpu-features  Prints the CPU's vector extensions and the kernels picked for them");
+    puts("  --cpu-level l   Uses the sse2, avx2 or avx512 kernels instead of the best the CPU runs");
+    puts("  -v, --version   Prints version");
+    puts("  -H, --help      Prints help");
+    puts("Interlaced PNGs rendered at half size or smaller are sampled from only the passes that size needs,");
+    puts("so their output is approximate and can differ slightly from the same image saved without interlacing");
+}
+
+void set_config(config *conf, int argc, char **argv) {
+    default_config(conf);
+    conf->filenames = malloc(sizeof(char*) * argc);
+    if(!conf->filenames) {
+        fputs("Error allocating memory for filenames...\n", stderr);
+        exit(1);
+    }
+    int scaling_token_index = -1;
+    int h_scaling_token_index = -1;
+    int w_scaling_token_index = -1;
+    int custom_characters_index = -1;
+    int dither_token_index = -1;
+    int threads_token_index = -1;
+    int columns_token_index = -1;
+    int rows_token_index = -1;
+    int output_token_index = -1;
+    int format_token_index = -1;
+    int crop_token_index = -1;
+    int rotate_token_index = -1;
+    int prefetch_token_index = -1;
+    int shard_token_index = -1;
+    int manifest_token_index = -1;
+    int montage_token_index = -1;
+    int save_lum_token_index = -1;
+    int cpu_level_token_index = -1;
+    int stream_token_index = -1;
+    int latency_token_index = -1;
+    int tolerance_token_index = -1;
+    int invert_count = 0;
+    int custom_characters_count = 0;
+    int flip_token_index = -1;
+    int rotation = 0;
+    int flip = 0;
+    double scales[MAX_VARIANTS] = {1.0};
+    int scale_count = 1;
+    int w_count = 0;
+    int h_count = 0;
+    // The last argument is always an image file, except with --stream which reads none
+    int last_file = argc-1;
+    for(int i = 1; i < argc; i++) {
+        if(strcmp(argv[i], "--stream") == 0) {
+            last_file = -1;
+        }
+    }
+    for(int i = 1; i < argc; i++) {
+        char *token = argv[i];
+        int index_mod = 1;
+        if(strcmp(token, "--help") == 0) {
+            print_help();
+            exit(0);
+        }
+        else if(strcmp(token, "--version") == 0) {
+            print_version();
+            exit(0);
+        }
+        else if(strcmp(token, "--cpu-features") == 0) {
+            print_cpu_features();
+            exit(0);
+        }
+        else if(strcmp(token, "--huge-pages") == 0) {
+            conf->huge_pages = true;
+        }
+        else if(strcmp(token, "--cpu-level") == 0) {
+            cpu_level_token_index = i+1;
+        }
+        else if(strcmp(token, "--stream") == 0) {
+            stream_token_index = i+1;
+        }
+        else if(strcmp(token, "--max-latency") == 0) {
+            latency_token_index = i+1;
+        }
+        else if(strcmp(token, "--frame-tolerance") == 0) {
+            tolerance_token_index = i+1;
+        }
+        else if(strcmp(token, "--no-frame-cache") == 0) {
+            conf->cache_frames = false;
+        }
+        else if(strcmp(token, "--dither") == 0) {
+            dither_token_index = i+1;
+        }
+        else if(strcmp(token, "--threads") == 0) {
+            threads_token_index = i+1;
+        }
+        else if(strcmp(token, "--stats") == 0) {
+            conf->stats = true;
+        }
+        else if(strcmp(token, "--format") == 0) {
+            format_token_index = i+1;
+        }
+        else if(strcmp(token, "--crop") == 0) {
+            crop_token_index = i+1;
+        }
+        else if(strcmp(token, "--plan") == 0) {
+            conf->plan = true;
+        }
+        else if(strcmp(token, "--prefer-thumbnail") == 0) {
+            conf->prefer_thumbnail = true;
+        }
+        else if(strcmp(token, "--rotate") == 0) {
+            rotate_token_index = i+1;
+        }
+        else if(strcmp(token, "--flip") == 0) {
+            flip_token_index = i+1;
+        }
+        else if(strcmp(token, "--ignore-orientation") == 0) {
+            conf->exif_orientation = false;
+        }
+        else if(strcmp(token, "--prefetch") == 0) {
+            prefetch_token_index = i+1;
+        }
+        else if(strcmp(token, "--shard") == 0) {
+            shard_token_index = i+1;
+        }
+        else if(strcmp(token, "--manifest") == 0) {
+            manifest_token_index = i+1;
+        }
+        else if(strcmp(token, "--montage") == 0) {
+            montage_token_index = i+1;
+        }
+        else if(strcmp(token, "--captions") == 0) {
+            conf->captions = true;
+        }
+        else if(strcmp(token, "--edges") == 0) {
+            conf->edges = true;
+        }
+        else if(strcmp(token, "--save-lum") == 0) {
+            save_lum_token_index = i+1;
+        }
+        else if(strcmp(token, "--from-lum") == 0) {
+            conf->from_lum = true;
+        }
+        else if(strcmp(token, "--auto-contrast") == 0) {
+            conf->tone = TONE_AUTO_CONTRAST;
+        }
+        else if(strcmp(token, "--equalize") == 0) {
+            conf->tone = TONE_EQUALIZE;
+        }
+        else if(strcmp(token, "--fit") == 0) {
+            conf->fit = true;
+        }
+        else if(strcmp(token, "--cols") == 0) {
+            columns_token_index = i+1;
+        }
+        else if(strcmp(token, "--rows") == 0) {
+            rows_token_index = i+1;
+        }
+        else if(token[0] == '-') {
+            for(size_t j = 1; j < strlen(token); j++) {
+                char currOpt = token[j];
+                switch(currOpt) {
+                    case 'i':
+                        conf->invert = true;
+                        invert_count++;
+                        break;
+                    case 's':
+                        scaling_token_index = i+index_mod;
+                        index_mod++;
+                        break;
+                    case 'w':
+                        w_scaling_token_index = i+index_mod;
+                        index_mod++;
+                        break;
+                    case 'h':
+                        h_scaling_token_index = i+index_mod;
+                        index_mod++;
+                        break;
+                    case 'c':
+                        custom_characters_index = i+index_mod;
+                        index_mod++;
+                        break;
+                    case 'o':
+                        output_token_index = i+index_mod;
+                        index_mod++;
+                        break;
+                    case 'H':
+                        print_help();
+                        exit(0);
+                        break;
+                    case 'v':
+                    case 'V':
+                        print_version();
+                        exit(0);
+                        break;
+                }
+            }
+        }
+        else if(i == scaling_token_index && i != last_file) {
+            scale_count = parse_scales(argv[i], scales);
+            conf->scaling = scales[0];
+        }
+        else if(i == w_scaling_token_index && i != last_file) {
+            w_count = parse_scales(argv[i], conf->w_scales);
+            conf->w_scaling = conf->w_scales[0];
+        }
+        else if(i == h_scaling_token_index && i != last_file) {
+            h_count = parse_scales(argv[i], conf->h_scales);
+            conf->h_scaling = conf->h_scales[0];
+        }
+        else if(i == custom_characters_index && i != last_file) {
+            // The first -c replaces the default set, any more add styles
+            if(custom_characters_count == 0) {
+                free(conf->character_sets[0]);
+                conf->character_set_count = 0;
+            }
+            if(conf->character_set_count == MAX_STYLES) {
+                fprintf(stderr, "At most %d character sets can be given.\n", MAX_STYLES);
+                exit(1);
+            }
+            conf->character_sets[conf->character_set_count++] = str_dup(argv[i]);
+            conf->character_set = conf->character_sets[0];
+            custom_characters_count++;
+        }
+        else if(i == output_token_index && i != last_file) {
+            free(conf->output_path);
+            conf->output_path = str_dup(argv[i]);
+        }
+        else if(i == crop_token_index && i != last_file) {
+            conf->crop = parse_crop(argv[i]);
+        }
+        else if(i == rotate_token_index && i != last_file) {
+            rotation = parse_rotation(argv[i]);
+        }
+        else if(i == flip_token_index && i != last_file) {
+            flip = parse_flip(argv[i]);
+        }
+        else if(i == format_token_index && i != last_file) {
+            conf->format = parse_format(argv[i]);
+        }
+        else if(i == dither_token_index && i != last_file) {
+            conf->dither = parse_dither(argv[i]);
+        }
+        else if(i == threads_token_index && i != last_file) {
+            conf->threads = parse_threads(argv[i]);
+        }
+        else if(i == prefetch_token_index && i != last_file) {
+            conf->prefetch = parse_count("--prefetch", argv[i]);
+        }
+        else if(i == shard_token_index && i != last_file) {
+            parse_shard(argv[i], conf);
+        }
+        else if(i == manifest_token_index && i != last_file) {
+            free(conf->manifest_path);
+            conf->manifest_path = str_dup(argv[i]);
+        }
+        else if(i == save_lum_token_index && i != last_file) {
+            free(conf->save_lum_path);
+            conf->save_lum_path = str_dup(argv[i]);
+        }
+        else if(i == cpu_level_token_index && i != last_file) {
+            conf->cpu_level = parse_cpu_level(argv[i]);
+        }
+        else if(i == stream_token_index && i != last_file) {
+            parse_stream(argv[i], conf);
+        }
+        else if(i == latency_token_index && i != last_file) {
+            conf->max_latency = parse_latency(argv[i]);
+        }
+        else if(i == tolerance_token_index && i != last_file) {
+            conf->frame_tolerance = parse_tolerance(argv[i]);
+        }
+        else if(i == montage_token_index && i != last_file) {
+            parse_montage(argv[i], conf);
+        }
+        else if(i == columns_token_index && i != last_file) {
+            conf->columns = parse_count("--cols", argv[i]);
+        }
+        else if(i == rows_token_index && i != last_file) {
+            conf->rows = parse_count("--rows", argv[i]);
+        }
+        else {
+            char *filename = str_dup(argv[i]);
+            if(!filename) {
+                fputs("Error allocating memory for filename...\n", stderr);
+                exit(1);
+            }
+            conf->filenames[conf->file_count++] = filename;
+        }
+    }
+    const bool stream = conf->stream_width > 0;
+    if(conf->file_count == 0 && !stream) {
+        fputs("No image file given.\n", stderr);
+        exit(1);
+    }
+    // Each character set is rendered as -i says, or both ways when -i is repeated
+    const int inversions = invert_count > 1 ? 2 : 1;
+    if(conf->character_set_count * inversions > MAX_STYLES) {
+        fprintf(stderr, "At most %d styles (character sets, times 2 with a repeated -i) can be rendered at once.\n", MAX_STYLES);
+        exit(1);
+    }
+    conf->style_count = 0;
+    for(int i = 0; i < conf->character_set_count; i++) {
+        if(strlen(conf->character_sets[i]) == 0) {
+            fputs("A character set can't be empty.\n", stderr);
+            exit(1);
+        }
+        for(int j = 0; j < inversions; j++) {
+            conf->style_sets[conf->style_count] = conf->character_sets[i];
+            conf->style_inverts[conf->style_count] = inversions == 2 ? j == 1 : conf->invert;
+            conf->style_count++;
+        }
+    }
+    conf->invert = conf->style_inverts[0];
+    const bool montage = conf->montage_columns > 0;
+    if(montage && conf->style_count > 1) {
+        fputs("--montage renders a single character set and -i.\n", stderr);
+        exit(1);
+    }
+    if(conf->output_path && conf->file_count > 1 && !conf->plan && !montage) {
+        fputs("-o can only be used with a single image.\n", stderr);
+        exit(1);
+    }
+    if(montage && (conf->format != FORMAT_TEXT || conf->crop.width > 0 || conf->manifest_path || conf->save_lum_path || conf->from_lum)) {
+        fputs("--montage only writes text, and can't be used with --crop, --manifest, --save-lum or --from-lum.\n", stderr);
+        exit(1);
+    }
+    if(stream && (conf->file_count > 0 || montage || conf->plan || conf->output_path || conf->format != FORMAT_TEXT ||
+                  conf->crop.width > 0 || conf->manifest_path || conf->save_lum_path || conf->from_lum || conf->style_count > 1)) {
+        fputs("--stream writes text for frames read from stdin to stdout with one character set, so it takes no image files\n"
+              "and can't be used with -o, --format, --montage, --plan, --crop, --manifest, --save-lum or --from-lum.\n", stderr);
+        exit(1);
+    }
+    if((conf->max_latency > 0.0 || conf->frame_tolerance > 0 || !conf->cache_frames) && !stream) {
+        fputs("--max-latency, --frame-tolerance and --no-frame-cache only apply to --stream.\n", stderr);
+        exit(1);
+    }
+    if(conf->from_lum && (conf->plan || conf->save_lum_path)) {
+        fputs("--from-lum renders saved grids, which can't be planned or saved again.\n", stderr);
+        exit(1);
+    }
+    if(conf->save_lum_path && conf->file_count > 1 && !conf->plan) {
+        fputs("--save-lum can only be used with a single image.\n", stderr);
+        exit(1);
+    }
+    conf->orientation = combine_orientation(rotation, flip);
+    if(fit_requested(conf)) {
+        return;
+    }
+    bool width_valid = w_count > 0;
+    bool height_valid = h_count > 0;
+    for(int i = 0; i < w_count; i++) {
+        width_valid = width_valid && conf->w_scales[i] > 0.0;
+    }
+    for(int i = 0; i < h_count; i++) {
+        height_valid = height_valid && conf->h_scales[i] > 0.0;
+    }
+    const bool even_scaling = w_count == 0 && h_count == 0;
+    if(!even_scaling && (!width_valid || !height_valid)) {
+        fputs("Invalid scaling parameters.\nIf not using equivalent scaling for height and width (-s) both height and width must be supplied and greater than 0.\n", stderr);
+        exit(1);
+    }
+    if(!even_scaling && w_count != h_count) {
+        fputs("Invalid scaling parameters.\nThe same number of width (-w) and height (-h) scaling factors must be given.\n", stderr);
+        exit(1);
+    }
+    if(even_scaling) {
+        for(int i = 0; i < scale_count; i++) {
+            conf->w_scales[i] = scales[i];
+            conf->h_scales[i] = scales[i];
+        }
+        conf->w_scaling = conf->scaling;
+        conf->h_scaling = conf->scaling;
+    }
+    conf->variant_count = even_scaling ? scale_count : w_count;
+    if(montage && conf->variant_count > 1) {
+        fputs("--montage renders every tile at a single size.\n", stderr);
+        exit(1);
+    }
+    if(stream && conf->variant_count > 1) {
+        fputs("--stream renders every frame at a single size.\n", stderr);
+        exit(1);
+    }
+}
+
+int write_error(const char *path, const char *temp_path, const char *reason) {
+    fprintf(stderr, "Error writing %s: %s\n", path, reason);
+    remove(temp_path);
+    return 1;
+}
+
+typedef void (*fill_fn)(char *dest, void *ctx);
+
+// The art followed by the blank line that separates images on stdout, so a file written
+// with -o holds the same bytes as the printed art
+void fill_rows(char *dest, void *ctx) {
+    const render_job *job = ctx;
+    render_rows(job->img, job->conf, dest);
+    dest[rendered_size(job->img)] = '\n';
+}
+
+void fill_copy(char *dest, void *ctx) {
+    const out_buffer *buf = ctx;
+    memcpy(dest, buf->data, buf->length);
+}
+
+// Lets fill write size bytes straight into a preallocated, memory-mapped temporary file next
+// to path, then renames it into place so readers never see a partially written file.
+int write_file(const char *path, const size_t size, fill_fn fill, void *ctx) {
+    const size_t path_length = strlen(path);
+    char *temp_path = malloc(path_length + 8);
+    if(!temp_path) {
+        fputs("Error allocating memory for output path...\n", stderr);
+        return 1;
+    }
+    memcpy(temp_path, path, path_length);
+    int status = 0;
+#if !defined(_WIN32)
+    memcpy(temp_path + path_length, ".XXXXXX", 8);
+    const int fd = mkstemp(temp_path);
+    if(fd < 0) {
+        fprintf(stderr, "Error writing %s: %s\n", path, strerror(errno));
+        free(temp_path);
+        return 1;
+    }
+    const mode_t mask = umask(0);
+    umask(mask);
+    fchmod(fd, 0666 & ~mask);
+    if(size > 0) {
+        int err = posix_fallocate(fd, 0, (off_t)size);
+        if(err == EINVAL || err == EOPNOTSUPP) {
+            err = ftruncate(fd, (off_t)size) == 0 ? 0 : errno;
+        }
+        char *map = err ? MAP_FAILED : mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if(map == MAP_FAILED) {
+            status = write_error(path, temp_path, strerror(err ? err : errno));
+        }
+        else {
+            fill(map, ctx);
+            munmap(map, size);
+        }
+    }
+    if(close(fd) != 0 && status == 0) {
+        status = write_error(path, temp_path, strerror(errno));
+    }
+    if(status == 0 && rename(temp_path, path) != 0) {
+        status = write_error(path, temp_path, strerror(errno));
+    }
+#else
+    memcpy(temp_path + path_length, ".tmp", 5);
+    char *art = malloc(size > 0 ? size : 1);
+    FILE *f = art ? fopen(temp_path, "wb") : NULL;
+    if(!f) {
+        status = write_error(path, temp_path, art ? "unable to create file" : "unable to allocate memory");
+    }
+    else {
+        fill(art, ctx);
+        const bool written = fwrite(art, 1, size, f) == size;
+        if(fclose(f) != 0 || !written) {
+            status = write_error(path, temp_path, "unable to write file");
+        }
+        else {
+            remove(path);
+            if(rename(temp_path, path) != 0) {
+                status = write_error(path, temp_path, "unable to rename file");
+            }
+        }
+    }
+    free(art);
+#endif
+    free(temp_path);
+    return status;
+}
+
+const char* image_format(const input_file *in) {
+    unsigned char magic[8] = {0};
+    const size_t read = read_input_start(in, magic, sizeof(magic));
+    if(read == 0) {
+        return "unknown";
+    }
+    if(read >= 8 && memcmp(magic, "\x89PNG\r\n\x1a\n", 8) == 0) {
+        return "png";
+    }
+    if(read >= 3 && magic[0] == 0xFF && magic[1] == 0xD8 && magic[2] == 0xFF) {
+        return "jpeg";
+    }
+    if(read >= 4 && memcmp(magic, "GIF8", 4) == 0) {
+        return "gif";
+    }
+    if(read >= 2 && memcmp(magic, "BM", 2) == 0) {
+        return "bmp";
+    }
+    if(read >= 4 && memcmp(magic, "8BPS", 4) == 0) {
+        return "psd";
+    }
+    if(read >= 2 && magic[0] == 'P' && magic[1] >= '1' && magic[1] <= '6') {
+        return "pnm";
+    }
+    if(read >= 2 && magic[0] == '#' && magic[1] == '?') {
+        return "hdr";
+    }
+    return "other";
+}
+
+// Prints one line of key=value pairs describing the work a render of filename would do.
+// Only the start of the file is read, once, and every probe runs over that, so whole
+// batches can be planned cheaply.
+int plan_file(const config *conf, const char *filename) {
+    const input_file file = {filename, NULL, 0};
+    size_t head_size = 0;
+    size_t total = 0;
+    unsigned char *head = read_file_head(&file, EXIF_SCAN_BYTES, &head_size, &total);
+    const input_file in = {filename, head, head_size};
+    int width, height, channel_count;
+    bool known = head && stbi_info_from_memory(head, (int)head_size, &width, &height, &channel_count);
+    // A JPEG can hold more metadata than that before its frame header
+    if(!known && (!head || head_size < total)) {
+        known = stbi_info(filename, &width, &height, &channel_count);
+    }
+    if(!known) {
+        printf("file=%s error=\"%s\"\n", filename, stbi_failure_reason());
+        free(head);
+        return 1;
+    }
+    const char *format = image_format(&in);
+    const char *decode = "full";
+    size_t decode_bytes = (size_t)width * height * channel_count;
+    // The EXIF is parsed in place, so it is never closed
+    exif_info exif = {head, head_size, total, 0, 0, 0};
+    if((conf->exif_orientation || conf->prefer_thumbnail) && strcmp(format, "jpeg") == 0 && head) {
+        parse_exif(head, head_size, &exif);
+    }
+    config file_conf = *conf;
+    file_conf.orientation = combine_orientation(conf->exif_orientation ? exif.orientation : 0, conf->orientation);
+    const bool transpose = file_conf.orientation & ORIENT_TRANSPOSE;
+    if(conf->crop.width > 0) {
+        crop_rect crop = conf->crop;
+        if(crop.x >= (transpose ? height : width) || crop.y >= (transpose ? width : height)) {
+            printf("file=%s error=\"crop outside image\"\n", filename);
+            free(head);
+            return 1;
+        }
+        clamp_crop(&crop, transpose ? height : width, transpose ? width : height, filename);
+        crop = orient_crop(&crop, file_conf.orientation, width, height);
+        if(strcmp(format, "png") == 0 && png_rows_supported(&in)) {
+            decode = "rows";
+            decode_bytes = ((size_t)width * channel_count + 1) * (crop.y + crop.height) + (size_t)crop.width * crop.height * channel_count;
+        }
+        width = crop.width;
+        height = crop.height;
+    }
+    int widths[MAX_VARIANTS];
+    int heights[MAX_VARIANTS];
+    const int count = variant_grids(&file_conf, width, height, widths, heights);
+    int resize_width = width;
+    int resize_height = height;
+    if(conf->prefer_thumbnail && conf->crop.width <= 0) {
+        int grid_width, grid_height;
+        image_data thumb;
+        largest_grid(widths, heights, count, &grid_width, &grid_height);
+        if(find_thumbnail(&exif, width, height, grid_width, grid_height, &thumb)) {
+            decode = "thumbnail";
+            decode_bytes = (size_t)thumb.width * thumb.height * thumb.channel_count;
+            resize_width = thumb.width;
+            resize_height = thumb.height;
+        }
+    }
+    png_decoder png;
+    if(conf->crop.width <= 0 && strcmp(format, "png") == 0 && png_probe(&in, &png) && png.interlaced) {
+        int grid_width, grid_height;
+        largest_grid(widths, heights, count, &grid_width, &grid_height);
+        const int last = adam7_last_pass(&png, grid_width, grid_height);
+        if(last >= 0) {
+            const int *step = adam7_lattice[last];
+            decode = "passes";
+            resize_width = (width + step[0] - 1) / step[0];
+            resize_height = (height + step[1] - 1) / step[1];
+            decode_bytes = (size_t)resize_width * resize_height * channel_count;
+            for(int pass = 0; pass <= last; pass++) {
+                int pass_width, pass_height;
+                decode_bytes += adam7_pass_size(&png, pass, &pass_width, &pass_height);
+            }
+        }
+    }
+#if defined(ASCIIGEN_THREADS)
+    if(conf->crop.width <= 0 && conf->threads > 1 && strcmp(format, "png") == 0 && png_rows_supported(&in)) {
+        decode = "pipelined";
+    }
+    if(conf->threads > 1 && strcmp(format, "jpeg") == 0 && strcmp(decode, "full") == 0 && jpeg_has_restarts(head, head_size)) {
+        decode = "restarts";
+    }
+#endif
+#if !defined(_WIN32)
+    image_data mapped;
+    size_t pixels;
+    if(strcmp(format, "pnm") == 0 && head && pnm_layout(head, head_size, total, &mapped, &pixels)) {
+        decode = "mapped";
+        decode_bytes = 0;
+    }
+#endif
+    free(head);
+    size_t resize_bytes = 0;
+    size_t output_bytes = 0;
+    printf("file=%s format=%s source=%dx%d channels=%d grid=", filename, format, width, height, channel_count);
+    for(int i = 0; i < count; i++) {
+        const int grid_width = transpose ? heights[i] : widths[i];
+        const int grid_height = transpose ? widths[i] : heights[i];
+        if(widths[i] != resize_width || heights[i] != resize_height) {
+            resize_bytes += (size_t)grid_width * grid_height * channel_count;
+        }
+        output_bytes += ((size_t)(grid_width + 1) * grid_height + 1) * conf->style_count;
+        printf(i > 0 ? ",%dx%d" : "%dx%d", grid_width, grid_height);
+    }
+    printf(" decode_bytes=%zu resize_bytes=%zu output_bytes=%zu decode=%s threads=%d dither=%s output=%s%s\n",
+           decode_bytes, resize_bytes, output_bytes, decode, conf->threads, dither_name(conf->dither),
+           conf->format == FORMAT_HTML ? "html" : conf->format == FORMAT_SVG ? "svg" : "text",
+           file_conf.orientation ? " oriented=yes" : "");
+    return 0;
+}
+
+// Maps the resized image, turned to conf->orientation, to characters and writes it to
+// stdout or conf->output_path, adding the bytes written to *written.
+int output_view(const image_view *img, const config *conf, size_t *written) {
+    if(conf->format != FORMAT_TEXT) {
+        out_buffer markup = {NULL, 0, 0};
+        if(!render_markup(img, conf, &markup)) {
+            fputs("Error creating art string... Unable to allocate memory\n", stderr);
+            return 1;
+        }
+        int status = 0;
+        if(conf->output_path) {
+            status = write_file(conf->output_path, markup.length, fill_copy, &markup);
+        }
+        else if(fwrite(markup.data, 1, markup.length, stdout) != markup.length) {
+            status = 1;
+        }
+        *written += markup.length;
+        free(markup.data);
+        return status;
+    }
+    if(conf->output_path) {
+        render_job job = {img, conf, NULL, 0, true, NULL, NULL, NULL};
+        *written += rendered_size(img) + 1;
+        return write_file(conf->output_path, rendered_size(img) + 1, fill_rows, &job);
+    }
+    char *art = image_to_string(img, conf);
+    if(!art) {
+        fputs("Error creating art string... Unable to allocate memory\n", stderr);
+        return 1;
+    }
+    *written += strlen(art) + 1;
+    puts(art);
+    arena_free(art);
+    return 0;
+}
+
+int output_art(const image_data *image, const config *conf, size_t *written) {
+    const image_view view = orient_view(image, conf->orientation);
+    return output_view(&view, conf, written);
+}
+
+// Inserts .tag before the extension of path.
+char* tagged_path(const char *path, const char *tag) {
+    const char *slash = strrchr(path, '/');
+    const char *dot = strrchr(path, '.');
+    const size_t stem = dot && (!slash || dot > slash) ? (size_t)(dot - path) : strlen(path);
+    const size_t size = strlen(path) + strlen(tag) + 2;
+    char *result = malloc(size);
+    if(result) {
+        snprintf(result, size, "%.*s.%s%s", (int)stem, path, tag, path + stem);
+    }
+    return result;
+}
+
+// Names the output of one of several sizes by inserting the size before the extension,
+// e.g. art.txt becomes art.80x40.txt.
+char* variant_path(const char *path, const int width, const int height) {
+    char tag[32];
+    snprintf(tag, sizeof(tag), "%dx%d", width, height);
+    return tagged_path(path, tag);
+}
+
+// Names the output of one of several styles by the number of its character set and an i
+// when it is the inverted one of a pair, e.g. art.txt becomes art.c2i.txt.
+char* style_path(const char *path, const config *conf, const int style) {
+    const int inversions = conf->style_count / conf->character_set_count;
+    char tag[32];
+    snprintf(tag, sizeof(tag), "c%d%s", style / inversions + 1, inversions == 2 && conf->style_inverts[style] ? "i" : "");
+    return tagged_path(path, tag);
+}
+
+// Renders a view once per style. With several styles view->brightness is expected to be
+// set, so each style is only a pass of its own ramp over the brightness already computed.
+int output_view_styles(const image_view *view, const config *conf, size_t *written) {
+    if(conf->style_count == 1) {
+        return output_view(view, conf, written);
+    }
+    int status = 0;
+    for(int i = 0; i < conf->style_count; i++) {
+        config style_conf = *conf;
+        style_conf.character_set = conf->style_sets[i];
+        style_conf.invert = conf->style_inverts[i];
+        if(conf->output_path) {
+            style_conf.output_path = style_path(conf->output_path, conf, i);
+            if(!style_conf.output_path) {
+                fputs("Error allocating memory for output path...\n", stderr);
+                exit(1);
+            }
+        }
+        status |= output_view(view, &style_conf, written);
+        if(style_conf.output_path != conf->output_path) {
+            free(style_conf.output_path);
+        }
+    }
+    return status;
+}
+
+#define FNV_OFFSET 0xcbf29ce484222325ULL
+
+// 64-bit FNV-1a over size bytes, continuing from hash so fields can be chained.
+uint64_t fnv1a(const void *data, const size_t size, uint64_t hash) {
+    const unsigned char *bytes = data;
+    for(size_t i = 0; i < size; i++) {
+        hash = (hash ^ bytes[i]) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+// Identifies an input by its path, size and modification time, so a file that changed
+// since it was recorded in a manifest is rendered again.
+uint64_t input_hash(const char *path) {
+    uint64_t hash = fnv1a(path, strlen(path) + 1, FNV_OFFSET);
+#if !defined(_WIN32)
+    struct stat st;
+    if(stat(path, &st) == 0) {
+        const int64_t stamp[2] = {(int64_t)st.st_size, (int64_t)st.st_mtime};
+        hash = fnv1a(stamp, sizeof(stamp), hash);
+    }
+#endif
+    return hash;
+}
+
+// A --save-lum file is "ASCIILUM", the format version, width, height and flags as 32-bit
+// and the input_hash of the source as a 64-bit little-endian value, then the brightness
+// of every cell as a little-endian IEEE double, row by row as shown, and with
+// LUM_HAS_COLOR the color of every cell as RGB. The brightness is kept exactly as the
+// kernels computed it, so a --from-lum render maps it to the same characters as a render
+// of the source. Version 1 files held it rounded to a byte, and are still read.
+#define LUM_MAGIC "ASCIILUM"
+#define LUM_VERSION 2
+#define LUM_BYTE_VERSION 1
+#define LUM_HAS_COLOR 1
+#define LUM_HEADER_SIZE 32
+
+void put_le(unsigned char *p, const uint64_t value, const int bytes) {
+    for(int i = 0; i < bytes; i++) {
+        p[i] = (unsigned char)(value >> (8 * i));
+    }
+}
+
+// Builds the --save-lum file of img, whose brightness is already computed, in a new
+// buffer of *size bytes. Colors are kept for color images, for --format html and svg.
+unsigned char* build_lum(const image_view *img, const char *source, size_t *size) {
+    const bool color = img->channel_count >= 3;
+    const size_t cell_count = (size_t)img->width * img->height;
+    *size = LUM_HEADER_SIZE + cell_count * (color ? 11 : 8);
+    unsigned char *out = arena_malloc(*size);
+    if(!out) {
+        return NULL;
+    }
+    memcpy(out, LUM_MAGIC, 8);
+    put_le(out + 8, LUM_VERSION, 4);
+    put_le(out + 12, (uint64_t)img->width, 4);
+    put_le(out + 16, (uint64_t)img->height, 4);
+    put_le(out + 20, color ? LUM_HAS_COLOR : 0, 4);
+    put_le(out + 24, input_hash(source), 8);
+    unsigned char *lum = out + LUM_HEADER_SIZE;
+    unsigned char *rgb = lum + cell_count * 8;
+    for(size_t cell = 0; cell < cell_count; cell++) {
+        uint64_t bits;
+        memcpy(&bits, img->brightness + cell, 8);
+        put_le(lum + cell * 8, bits, 8);
+    }
+    for(int y = 0; y < img->height && color; y++) {
+        for(int x = 0; x < img->width; x++) {
+            const size_t cell = (size_t)y * img->width + x;
+            const uint32_t rgb_color = pixel_color(img, x, y);
+            rgb[cell * 3] = (unsigned char)(rgb_color >> 16);
+            rgb[cell * 3 + 1] = (unsigned char)(rgb_color >> 8);
+            rgb[cell * 3 + 2] = (unsigned char)rgb_color;
+        }
+    }
+    return out;
+}
+
+// Renders image in every style and saves its grid to --save-lum, named after its size
+// when there are several. With several styles or a grid to save, the brightness of each
+// cell is computed once, exactly as a single style would, and every style maps it with its
+// own ramp, so each prints the same art as it does alone.
+int output_styles(const image_data *image, const config *conf, const char *source, const bool several, size_t *written) {
+    if(conf->style_count == 1 && !conf->save_lum_path) {
+        return output_art(image, conf, written);
+    }
+    image_view view = orient_view(image, conf->orientation);
+    int status = 0;
+    double *brightness = arena_malloc(sizeof(double) * view.width * view.height + 1);
+    if(!brightness) {
+        fputs("Error allocating memory for luminance grid...\n", stderr);
+        exit(1);
+    }
+    compute_brightness(&view, lum_workers(&view, conf->threads), brightness);
+    view.brightness = brightness;
+    if(conf->save_lum_path) {
+        char *lum_path = several ? variant_path(conf->save_lum_path, view.width, view.height) : conf->save_lum_path;
+        out_buffer saved = {NULL, 0, 0};
+        saved.data = lum_path ? (char*)build_lum(&view, source, &saved.length) : NULL;
+        if(!saved.data) {
+            fputs("Error allocating memory for luminance grid...\n", stderr);
+            exit(1);
+        }
+        status |= write_file(lum_path, saved.length, fill_copy, &saved);
+        if(lum_path != conf->save_lum_path) {
+            free(lum_path);
+        }
+        arena_free(saved.data);
+    }
+    status |= output_view_styles(&view, conf, written);
+    arena_free(brightness);
+    return status;
+}
+
+// Decodes in once and renders every requested size from it. Sizes are produced
+// largest first, each resized from the smallest already produced image that still covers
+// it, so small sizes never go back to the full resolution source. The bytes written for
+// all sizes are added to *written.
+int render_file(const config *conf, const input_file *in, size_t *written) {
+    image_data img = {NULL, 0, 0, 0, 0};
+    decode_info info = {"full", 0, 0};
+    crop_rect crop = conf->crop;
+    const bool cropped = crop.width > 0;
+    const bool fit = fit_requested(conf);
+    const bool try_thumbnail = conf->prefer_thumbnail && !cropped;
+    const bool try_passes = !cropped && png_interlaced(in);
+#if defined(ASCIIGEN_THREADS)
+    const bool try_pipeline = !cropped && conf->threads > 1 && png_rows_supported(in);
+    const bool try_restarts = conf->threads > 1 && jpeg_restarts(in);
+#else
+    const bool try_pipeline = false;
+#endif
+    int widths[MAX_VARIANTS];
+    int heights[MAX_VARIANTS];
+    int count = 0;
+    bool reduced = false;
+    bool pipelined = false;
+    image_data streamed = {NULL, 0, 0, 0, 0};
+    const double start = now_ms();
+    exif_info exif = {NULL, 0, 0, 0, 0, 0};
+    if((conf->exif_orientation || try_thumbnail) && strcmp(image_format(in), "jpeg") == 0) {
+        read_exif(in, &exif);
+    }
+    config file_conf = *conf;
+    file_conf.orientation = combine_orientation(conf->exif_orientation ? exif.orientation : 0, conf->orientation);
+    const bool transpose = file_conf.orientation & ORIENT_TRANSPOSE;
+    if(fit || cropped || try_thumbnail || try_passes || try_pipeline) {
+        if(!probe_image(&img, in)) {
+            exif_close(&exif);
+            return load_error(in->name);
+        }
+        if(cropped) {
+            // The crop is given in the pixels of the oriented image
+            clamp_crop(&crop, transpose ? img.height : img.width, transpose ? img.width : img.height, in->name);
+            crop = orient_crop(&crop, file_conf.orientation, img.width, img.height);
+        }
+    }
+    if(try_thumbnail || try_passes || try_pipeline) {
+        // The grids come from the full size, so a thumbnail or the early interlace passes
+        // only change what they are resized from
+        int grid_width, grid_height;
+        count = variant_grids(&file_conf, img.width, img.height, widths, heights);
+        largest_grid(widths, heights, count, &grid_width, &grid_height);
+        reduced = (try_thumbnail && decode_thumbnail(&exif, img.width, img.height, grid_width, grid_height, &img, &info)) ||
+                  (try_passes && decode_png_passes(in, grid_width, grid_height, &img, &info));
+#if defined(ASCIIGEN_THREADS)
+        if(try_pipeline) {
+            // The largest grid is the one resized from the full image, so it is the one to stream
+            int first = 0;
+            for(int i = 1; i < count; i++) {
+                first = (long long)widths[i] * heights[i] > (long long)widths[first] * heights[first] ? i : first;
+            }
+            pipelined = decode_png_pipelined(in, conf->threads, widths[first], heights[first], &img, &streamed, &info);
+        }
+#endif
+    }
+    exif_close(&exif);
+    bool mapped = false;
+#if !defined(_WIN32)
+    mapped_file map = {NULL, 0};
+    mapped = !reduced && !pipelined && map_pnm(in, &img, &map, &info);
+#endif
+    if(mapped) {
+        if(cropped) {
+            crop_strided(&img, &crop);
+        }
+    }
+    else if(!reduced && !pipelined && (!cropped || !decode_png_region(in, &crop, &img, &info))) {
+#if defined(ASCIIGEN_THREADS)
+        if((!try_restarts || !decode_jpeg_restarts(in, conf->threads, &img, &info)) && !open_image(&img, in)) {
+            return load_error(in->name);
+        }
+#else
+        if(!open_image(&img, in)) {
+            return load_error(in->name);
+        }
+#endif
+        if(cropped) {
+            crop_image(&img, &crop);
+        }
+    }
+    const double decoded = now_ms();
+    if(!reduced && !pipelined) {
+        count = variant_grids(&file_conf, img.width, img.height, widths, heights);
+    }
+    if(conf->stats) {
+        fprintf(stderr, "decode: %9.3f ms  %dx%d, %d channels, %s decode", decoded - start, img.width, img.height, img.channel_count, info.method);
+        if(info.compressed_total > 0) {
+            fprintf(stderr, ", %zu of %zu compressed bytes", info.compressed_used, info.compressed_total);
+        }
+        fputs("\n", stderr);
+    }
+
+    image_data variants[MAX_VARIANTS];
+    bool done[MAX_VARIANTS] = {false};
+    bool owned[MAX_VARIANTS] = {false};
+    for(int step = 0; step < count; step++) {
+        int next = -1;
+        for(int i = 0; i < count; i++) {
+            if(!done[i] && (next < 0 || (long long)widths[i] * heights[i] > (long long)widths[next] * heights[next])) {
+                next = i;
+            }
+        }
+        const image_data *base = &img;
+        for(int i = 0; i < count; i++) {
+            if(done[i] && variants[i].width >= widths[next] && variants[i].height >= heights[next] &&
+               (long long)variants[i].width * variants[i].height < (long long)base->width * base->height) {
+                base = &variants[i];
+            }
+        }
+        const double resize_start = now_ms();
+        const bool during_decode = streamed.data && base == &img && widths[next] == streamed.width && heights[next] == streamed.height;
+        if(during_decode) {
+            variants[next] = streamed;
+            owned[next] = true;
+            streamed.data = NULL;
+        }
+        else if(widths[next] == base->width && heights[next] == base->height) {
+            variants[next] = *base;
+        }
+        else {
+            resize_into(base, &variants[next], widths[next], heights[next]);
+            owned[next] = true;
+        }
+        done[next] = true;
+        if(conf->stats) {
+            fprintf(stderr, "resize: %9.3f ms  %dx%d from %dx%d%s\n", now_ms() - resize_start, widths[next], heights[next], base->width, base->height,
+                    during_decode ? ", during decode" : "");
+        }
+    }
+
+    int status = 0;
+    for(int i = 0; i < count; i++) {
+        config variant_conf = file_conf;
+        const int shown_width = transpose ? heights[i] : widths[i];
+        const int shown_height = transpose ? widths[i] : heights[i];
+        if(count > 1 && conf->output_path) {
+            variant_conf.output_path = variant_path(conf->output_path, shown_width, shown_height);
+            if(!variant_conf.output_path) {
+                fputs("Error allocating memory for output path...\n", stderr);
+                exit(1);
+            }
+        }
+        const double map_start = now_ms();
+        status |= output_styles(&variants[i], &variant_conf, in->name, count > 1, written);
+        const double mapped = now_ms();
+        if(variant_conf.output_path != conf->output_path) {
+            free(variant_conf.output_path);
+        }
+        if(conf->stats) {
+            const double cells = (double)widths[i] * heights[i];
+            char styles[32] = "";
+            if(conf->style_count > 1) {
+                snprintf(styles, sizeof(styles), "%d styles, ", conf->style_count);
+            }
+            fprintf(stderr, "map:    %9.3f ms  %dx%d, %.1f ns/cell, %sdither %s%s%s, %d threads\n", mapped - map_start, shown_width, shown_height,
+                    cells > 0 ? (mapped - map_start) * 1e6 / cells : 0.0, styles, dither_name(conf->dither), conf->edges ? ", edges" : "",
+                    conf->tone == TONE_EQUALIZE ? ", equalize" : (conf->tone == TONE_AUTO_CONTRAST ? ", auto-contrast" : ""), conf->threads);
+        }
+    }
+    for(int i = 0; i < count; i++) {
+        if(owned[i]) {
+            arena_free(variants[i].data);
+        }
+    }
+    arena_free(streamed.data);
+#if !defined(_WIN32)
+    if(mapped) {
+        unmap_file(&map);
+        return status;
+    }
+#endif
     stbi_image_free(img.data);
-    if(!art) {
-        fputs("Error creating art string... Unable to allocate memory\n", stderr);
+    return status;
+}
+
+// Renders a grid saved with --save-lum. Only the mapping runs, so the size, crop and
+// orientation are the ones it was saved with.
+int render_lum(const config *conf, const input_file *in, size_t *written) {
+    const double start = now_ms();
+    size_t size;
+    unsigned char *data = read_input(in, &size);
+    if(!data) {
+        fprintf(stderr, "Error reading %s: %s\n", in->name, strerror(errno));
         return 1;
     }
-    puts(art);
-    free(art);
-    return 0;
+    const uint32_t version = size >= LUM_HEADER_SIZE && memcmp(data, LUM_MAGIC, 8) == 0 ? tiff_read(data + 8, 4, false) : 0;
+    const bool header = version == LUM_VERSION || version == LUM_BYTE_VERSION;
+    const size_t cell_bytes = version == LUM_BYTE_VERSION ? 1 : 8;
+    const uint32_t width = header ? tiff_read(data + 12, 4, false) : 0;
+    const uint32_t height = header ? tiff_read(data + 16, 4, false) : 0;
+    const bool color = header && (tiff_read(data + 20, 4, false) & LUM_HAS_COLOR);
+    const size_t cell_count = (size_t)width * height;
+    if(width == 0 || height == 0 || width > STBI_MAX_DIMENSIONS || height > STBI_MAX_DIMENSIONS ||
+       (size - LUM_HEADER_SIZE) / (cell_bytes + (color ? 3 : 0)) < cell_count) {
+        fprintf(stderr, "Error loading %s: not a grid saved with --save-lum\n", in->name);
+        release_input(in, data);
+        return 1;
+    }
+    const unsigned char *lum = data + LUM_HEADER_SIZE;
+    const unsigned char *rgb = lum + cell_count * cell_bytes;
+    // Exact brightness is decoded to doubles, and rounded to the bytes that stand in for
+    // the pixels of gray images. A value the kernels can't produce means a damaged file.
+    double *brightness = NULL;
+    unsigned char *gray = NULL;
+    if(version == LUM_VERSION) {
+        brightness = arena_malloc(sizeof(double) * cell_count);
+        gray = color ? NULL : arena_malloc(cell_count);
+        if(!brightness || (!color && !gray)) {
+            fputs("Error allocating memory for luminance grid...\n", stderr);
+            exit(1);
+        }
+        bool valid = true;
+        for(size_t cell = 0; cell < cell_count; cell++) {
+            const unsigned char *p = lum + cell * 8;
+            const uint64_t bits = tiff_read(p, 4, false) | (uint64_t)tiff_read(p + 4, 4, false) << 32;
+            memcpy(brightness + cell, &bits, 8);
+            valid &= brightness[cell] >= 0.0 && brightness[cell] <= 255.05;
+            if(gray) {
+                gray[cell] = (unsigned char)(valid ? brightness[cell] + 0.5 : 0);
+            }
+        }
+        if(!valid) {
+            fprintf(stderr, "Error loading %s: not a grid saved with --save-lum\n", in->name);
+            arena_free(gray);
+            arena_free(brightness);
+            release_input(in, data);
+            return 1;
+        }
+    }
+    // Colors come from the saved RGB, or are the brightness itself for gray images
+    const unsigned char *pixels = color ? rgb : gray ? gray : lum;
+    const int channel_count = color ? 3 : 1;
+    const image_view view = {pixels, channel_count, (ptrdiff_t)width * channel_count, (int)height, (int)width, channel_count,
+                             brightness ? NULL : lum, brightness};
+    const double loaded = now_ms();
+    const int status = output_view_styles(&view, conf, written);
+    const double mapped = now_ms();
+    if(conf->stats) {
+        const uint64_t source = tiff_read(data + 24, 4, false) | (uint64_t)tiff_read(data + 28, 4, false) << 32;
+        fprintf(stderr, "load:   %9.3f ms  %ux%u grid saved from source %016llx\n", loaded - start, width, height, (unsigned long long)source);
+        fprintf(stderr, "map:    %9.3f ms  %ux%u, %.1f ns/cell\n", mapped - loaded, width, height, (mapped - loaded) * 1e6 / cell_count);
+    }
+    arena_free(gray);
+    arena_free(brightness);
+    release_input(in, data);
+    return status;
+}
+
+// Columns of space between the tiles of a montage
+#define MONTAGE_GAP 1
+
+// One input of a montage: its stored size and orientation, read from its header, and the
+// grid it is rendered at, in stored orientation. Workers set error when it can't be read,
+// and the tile is left blank apart from a note.
+typedef struct montage_tile {
+    const char *path;
+    int src_width;
+    int src_height;
+    int orientation;
+    int width;
+    int height;
+    const char *error;
+} montage_tile;
+
+// A montage lays its tiles out row by row in pages of columns x rows cells, each
+// cell_width x cell_height characters plus the caption line, with a blank line between
+// pages. Every line is line_width characters and a newline, so each tile's rectangle of
+// the output is known before any image is decoded.
+typedef struct montage {
+    const config *conf;
+    config tile_conf;
+    montage_tile *tiles;
+    int tile_count;
+    int columns;
+    int rows;
+    int pages;
+    int cell_width;
+    int cell_height;
+    int caption_rows;
+    int line_width;
+    int lines;
+} montage;
+
+typedef struct montage_job {
+    const montage *m;
+    char *dest;
+} montage_job;
+
+// The config a tile is rendered with. With a bound on the whole montage each tile is fit
+// to its share of it, and each tile is rendered by a single thread since the tiles
+// themselves are spread across the threads.
+config tile_config(const montage *m) {
+    config tile_conf = *m->conf;
+    tile_conf.threads = 1;
+    if(fit_requested(m->conf)) {
+        int max_columns, max_rows;
+        grid_bounds(m->conf, &max_columns, &max_rows);
+        tile_conf.fit = false;
+        tile_conf.columns = max_columns > 0 ? (max_columns - (m->columns - 1) * MONTAGE_GAP) / m->columns : 0;
+        tile_conf.rows = max_rows > 0 ? max_rows / m->rows - m->caption_rows : 0;
+        if(max_columns > 0 && tile_conf.columns < 1) {
+            tile_conf.columns = 1;
+        }
+        if(max_rows > 0 && tile_conf.rows < 1) {
+            tile_conf.rows = 1;
+        }
+    }
+    return tile_conf;
+}
+
+void montage_probe_worker(void *ctx, int worker, int worker_count) {
+    const montage_job *job = ctx;
+    const montage *m = job->m;
+    config tile_conf = m->tile_conf;
+    for(int i = worker; i < m->tile_count; i += worker_count) {
+        montage_tile *tile = &m->tiles[i];
+        const input_file in = {tile->path, NULL, 0};
+        exif_info exif = {NULL, 0, 0, 0, 0, 0};
+        if(m->conf->exif_orientation && strcmp(image_format(&in), "jpeg") == 0) {
+            read_exif(&in, &exif);
+            exif_close(&exif);
+        }
+        image_data img;
+        if(!probe_image(&img, &in)) {
+            tile->error = stbi_failure_reason();
+            continue;
+        }
+        tile->src_width = img.width;
+        tile->src_height = img.height;
+        tile->orientation = combine_orientation(m->conf->exif_orientation ? exif.orientation : 0, m->conf->orientation);
+        tile_conf.orientation = tile->orientation;
+        variant_grids(&tile_conf, img.width, img.height, &tile->width, &tile->height);
+    }
+}
+
+// Decodes a tile the cheapest way that still covers its grid. Returns true when it is a
+// binary PGM/PPM left mapped in map rather than decoded. img->data stays NULL when the
+// tile can't be read.
+bool decode_tile(const montage *m, const montage_tile *tile, image_data *img, mapped_file *map) {
+    const input_file in = {tile->path, NULL, 0};
+    decode_info info = {"full", 0, 0};
+    if(m->conf->prefer_thumbnail && strcmp(image_format(&in), "jpeg") == 0) {
+        exif_info exif = {NULL, 0, 0, 0, 0, 0};
+        read_exif(&in, &exif);
+        const bool reduced = decode_thumbnail(&exif, tile->src_width, tile->src_height, tile->width, tile->height, img, &info);
+        exif_close(&exif);
+        if(reduced) {
+            return false;
+        }
+    }
+    if(png_interlaced(&in) && decode_png_passes(&in, tile->width, tile->height, img, &info)) {
+        return false;
+    }
+#if !defined(_WIN32)
+    if(map_pnm(&in, img, map, &info)) {
+        return true;
+    }
+#else
+    (void)map;
+#endif
+    open_image(img, &in);
+    return false;
+}
+
+// Marks the cell of a tile that couldn't be read, cut to the cell width
+void write_unreadable(const int cell_width, char *dest) {
+    static const char note[] = "(unreadable)";
+    const int length = (int)sizeof(note) - 1;
+    memcpy(dest, note, length < cell_width ? length : cell_width);
+}
+
+// Writes the file name without its directory under a tile, cut to the cell width. Bytes
+// that could take other than a single column in a terminal are replaced so the line
+// keeps its width.
+void write_caption(const char *path, const int cell_width, char *dest) {
+    const char *slash = strrchr(path, '/');
+    const char *name = slash ? slash + 1 : path;
+    for(int i = 0; i < cell_width && name[i] != '\0'; i++) {
+        const unsigned char c = (unsigned char)name[i];
+        dest[i] = c >= 0x20 && c < 0x7f ? (char)c : '?';
+    }
+}
+
+void montage_render_worker(void *ctx, int worker, int worker_count) {
+    const montage_job *job = ctx;
+    const montage *m = job->m;
+    const size_t pitch = (size_t)m->line_width + 1;
+    const int per_page = m->columns * m->rows;
+    // Each worker renders its tiles one after another in an arena of its own
+    arena tiles;
+    arena_open(&tiles, m->conf->huge_pages);
+    for(int i = worker; i < m->tile_count; i += worker_count) {
+        montage_tile *tile = &m->tiles[i];
+        const int cell = i % per_page;
+        const int top = (i / per_page) * (m->rows * (m->cell_height + m->caption_rows) + 1) + (cell / m->columns) * (m->cell_height + m->caption_rows);
+        const int left = (cell % m->columns) * (m->cell_width + MONTAGE_GAP);
+
+        if(m->caption_rows > 0) {
+            write_caption(tile->path, m->cell_width, job->dest + (size_t)(top + m->cell_height) * pitch + left);
+        }
+        arena_begin(&tiles, arena_hint(tile->src_width, tile->src_height, 4));
+        image_data img = {NULL, 0, 0, 0, 0};
+        mapped_file map = {NULL, 0};
+        const bool mapped = !tile->error && decode_tile(m, tile, &img, &map);
+        if(!img.data) {
+            tile->error = tile->error ? tile->error : stbi_failure_reason();
+            write_unreadable(m->cell_width, job->dest + (size_t)top * pitch + left);
+            arena_end(&tiles);
+            continue;
+        }
+        image_data small = img;
+        if(img.width != tile->width || img.height != tile->height) {
+            resize_into(&img, &small, tile->width, tile->height);
+        }
+        const image_view view = orient_view(&small, tile->orientation);
+        // Tiles smaller than their cell are centred in it
+        const int x = left + (m->cell_width - view.width) / 2;
+        const int y = top + (m->cell_height - view.height) / 2;
+        render_cells(&view, &m->tile_conf, job->dest + (size_t)y * pitch + x, pitch);
+        if(small.data != img.data) {
+            arena_free(small.data);
+        }
+#if !defined(_WIN32)
+        if(mapped) {
+            unmap_file(&map);
+        }
+        else {
+            stbi_image_free(img.data);
+        }
+#else
+        (void)mapped;
+        stbi_image_free(img.data);
+#endif
+        arena_end(&tiles);
+    }
+    arena_close(&tiles);
+}
+
+void fill_montage(char *dest, void *ctx) {
+    montage_job *job = ctx;
+    const montage *m = job->m;
+    const size_t pitch = (size_t)m->line_width + 1;
+    memset(dest, ' ', pitch * m->lines);
+    for(int y = 0; y < m->lines; y++) {
+        dest[(size_t)y * pitch + m->line_width] = '\n';
+    }
+    // Followed by a blank line, as art printed for an image is
+    dest[pitch * m->lines] = '\n';
+    job->dest = dest;
+    const int workers = m->conf->threads < m->tile_count ? m->conf->threads : m->tile_count;
+    run_workers(workers > 1 ? workers : 1, montage_render_worker, job);
+}
+
+// Renders every input into one grid of tiles. The headers are read first to size the
+// cells, then the tiles are decoded, resized and mapped in parallel, each straight into
+// its own rectangle of the output, so there is no per-tile string to stitch together.
+int render_montage(const config *conf) {
+    const double start = now_ms();
+    montage m;
+    m.conf = conf;
+    m.tile_count = conf->file_count;
+    m.tiles = calloc(m.tile_count, sizeof(montage_tile));
+    if(!m.tiles) {
+        fputs("Error allocating memory for montage...\n", stderr);
+        exit(1);
+    }
+    for(int i = 0; i < m.tile_count; i++) {
+        m.tiles[i].path = conf->filenames[i];
+    }
+    m.columns = conf->montage_columns;
+    m.rows = conf->montage_rows;
+    m.caption_rows = conf->captions ? 1 : 0;
+    m.tile_conf = tile_config(&m);
+    montage_job job = {&m, NULL};
+    const int workers = conf->threads < m.tile_count ? conf->threads : m.tile_count;
+    run_workers(workers > 1 ? workers : 1, montage_probe_worker, &job);
+    const double probed = now_ms();
+
+    m.cell_width = 1;
+    m.cell_height = 1;
+    for(int i = 0; i < m.tile_count; i++) {
+        const bool transpose = m.tiles[i].orientation & ORIENT_TRANSPOSE;
+        const int shown_width = transpose ? m.tiles[i].height : m.tiles[i].width;
+        const int shown_height = transpose ? m.tiles[i].width : m.tiles[i].height;
+        m.cell_width = shown_width > m.cell_width ? shown_width : m.cell_width;
+        m.cell_height = shown_height > m.cell_height ? shown_height : m.cell_height;
+    }
+    const int per_page = m.columns * m.rows;
+    m.pages = (m.tile_count + per_page - 1) / per_page;
+    if(m.pages == 1) {
+        // A single page only needs as many rows of tiles as there are images to fill
+        m.rows = (m.tile_count + m.columns - 1) / m.columns;
+    }
+    m.line_width = m.columns * m.cell_width + (m.columns - 1) * MONTAGE_GAP;
+    m.lines = m.pages * m.rows * (m.cell_height + m.caption_rows) + m.pages - 1;
+    const size_t size = ((size_t)m.line_width + 1) * m.lines + 1;
+
+    int status = 0;
+    if(conf->output_path) {
+        status = write_file(conf->output_path, size, fill_montage, &job);
+    }
+    else {
+        char *art = malloc(size);
+        if(!art) {
+            fputs("Error creating art string... Unable to allocate memory\n", stderr);
+            free(m.tiles);
+            return 1;
+        }
+        fill_montage(art, &job);
+        if(fwrite(art, 1, size, stdout) != size) {
+            status = 1;
+        }
+        free(art);
+    }
+    // Reported once the workers are done, so a bad file neither stops the montage nor
+    // exits from a worker thread
+    for(int i = 0; i < m.tile_count; i++) {
+        if(m.tiles[i].error) {
+            fprintf(stderr, "Error loading image %s: %s. Its tile is left blank\n", m.tiles[i].path, m.tiles[i].error);
+            status = 1;
+        }
+    }
+    if(conf->stats) {
+        fprintf(stderr, "probe:  %9.3f ms  %d headers\n", probed - start, m.tile_count);
+        fprintf(stderr, "tiles:  %9.3f ms  %d tiles on %d pages of %dx%d cells of %dx%d, %d threads\n", now_ms() - probed,
+                m.tile_count, m.pages, m.columns, m.rows, m.cell_width, m.cell_height, workers > 1 ? workers : 1);
+    }
+    free(m.tiles);
+    return status;
+}
+
+// --stream renders raw frames read from stdin, one after another, for live feeds. A reader,
+// the render workers and an in-order writer hand frame slots to each other through bounded
+// rings, so no more than a few frames are ever in flight. Without --max-latency every frame
+// is rendered and the reader waits for a free slot, holding back whatever writes to stdin.
+// With it the reader never waits: a frame that arrives while every slot is busy is dropped,
+// as is one that has waited longer than the limit by the time a worker gets to it.
+#if defined(ASCIIGEN_THREADS)
+#define STREAM_STOP UINT32_MAX
+#define STREAM_SPINS 64
+
+typedef struct ring_cell {
+    size_t position;
+    uint32_t slot;
+} ring_cell;
+
+// A bounded queue of slot numbers that any number of threads push to and pop from without
+// locks. Each cell holds the position it can next be pushed (position) or popped
+// (position + 1) at, so pushes and pops only race each other for their own counter.
+typedef struct slot_ring {
+    ring_cell *cells;
+    size_t mask;
+    char push_line[64];
+    size_t push_position;
+    char pop_line[64];
+    size_t pop_position;
+} slot_ring;
+
+void ring_open(slot_ring *ring, const size_t capacity) {
+    size_t size = 2;
+    while(size < capacity) {
+        size *= 2;
+    }
+    ring->cells = malloc(sizeof(ring_cell) * size);
+    if(!ring->cells) {
+        fputs("Failed to allocate memory for frame queues\n", stderr);
+        exit(1);
+    }
+    for(size_t i = 0; i < size; i++) {
+        ring->cells[i].position = i;
+    }
+    ring->mask = size - 1;
+    ring->push_position = 0;
+    ring->pop_position = 0;
+}
+
+bool ring_push(slot_ring *ring, const uint32_t slot) {
+    size_t position = __atomic_load_n(&ring->push_position, __ATOMIC_RELAXED);
+    for(;;) {
+        ring_cell *cell = &ring->cells[position & ring->mask];
+        const ptrdiff_t lag = (ptrdiff_t)(__atomic_load_n(&cell->position, __ATOMIC_ACQUIRE) - position);
+        if(lag < 0) {
+            return false;
+        }
+        if(lag == 0 && __atomic_compare_exchange_n(&ring->push_position, &position, position + 1, true,
+                                                   __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            cell->slot = slot;
+            __atomic_store_n(&cell->position, position + 1, __ATOMIC_RELEASE);
+            return true;
+        }
+        if(lag > 0) {
+            position = __atomic_load_n(&ring->push_position, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+bool ring_pop(slot_ring *ring, uint32_t *slot) {
+    size_t position = __atomic_load_n(&ring->pop_position, __ATOMIC_RELAXED);
+    for(;;) {
+        ring_cell *cell = &ring->cells[position & ring->mask];
+        const ptrdiff_t lag = (ptrdiff_t)(__atomic_load_n(&cell->position, __ATOMIC_ACQUIRE) - (position + 1));
+        if(lag < 0) {
+            return false;
+        }
+        if(lag == 0 && __atomic_compare_exchange_n(&ring->pop_position, &position, position + 1, true,
+                                                   __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            *slot = cell->slot;
+            __atomic_store_n(&cell->position, position + ring->mask + 1, __ATOMIC_RELEASE);
+            return true;
+        }
+        if(lag > 0) {
+            position = __atomic_load_n(&ring->pop_position, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+// Waiting on a ring spins briefly, then yields, then sleeps a little at a time, so an idle
+// stage costs next to nothing while a busy one picks up work within a fraction of a frame.
+void ring_backoff(int *waits) {
+    if(*waits < STREAM_SPINS) {
+        (*waits)++;
+    }
+    else if(*waits < STREAM_SPINS * 2) {
+        sched_yield();
+        (*waits)++;
+    }
+    else {
+        const struct timespec pause = {0, 200000};
+        nanosleep(&pause, NULL);
+    }
+}
+
+uint32_t ring_wait_pop(slot_ring *ring) {
+    uint32_t slot;
+    int waits = 0;
+    while(!ring_pop(ring, &slot)) {
+        ring_backoff(&waits);
+    }
+    return slot;
+}
+
+void ring_wait_push(slot_ring *ring, const uint32_t slot) {
+    int waits = 0;
+    while(!ring_push(ring, slot)) {
+        ring_backoff(&waits);
+    }
+}
+
+// What a render worker last drew, and the pixels each glyph was drawn from, so the cells of
+// the next frame that haven't changed are kept instead of mapped again. A worker's frames
+// are a few apart with several workers, which is fine while only identical cells are kept,
+// as a glyph only depends on its pixel. With --frame-tolerance a kept glyph depends on
+// which earlier frames its worker saw, so render_stream then uses a single worker.
+typedef struct frame_cache {
+    unsigned char *pixels;
+    char *art;
+    char_ramp characters;
+    bool filled;
+    uint64_t frames;
+    uint64_t blocks;
+    uint64_t reused;
+    uint64_t unchanged;
+    double ms;
+    // Time spent on frames that were drawn in full, from which the time saved is estimated
+    double full_ms;
+    uint64_t full_blocks;
+} frame_cache;
+
+// Whether any of count cells of row y from x differs from the cached pixels by more than
+// tolerance in some channel.
+bool cells_changed(const image_view *img, const unsigned char *cached, const int x, const int y, const int count,
+                   const int tolerance) {
+    const int channels = img->channel_count;
+    const unsigned char *cell = img->data + x * img->x_step + y * img->y_step;
+    if(tolerance == 0 && img->x_step == channels) {
+        return memcmp(cell, cached, (size_t)count * channels) != 0;
+    }
+    for(int i = 0; i < count; i++, cell += img->x_step, cached += channels) {
+        for(int c = 0; c < channels; c++) {
+            if(abs(cell[c] - cached[c]) > tolerance) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+void keep_cells(const image_view *img, unsigned char *cached, const int x, const int y, const int count) {
+    const int channels = img->channel_count;
+    const unsigned char *cell = img->data + x * img->x_step + y * img->y_step;
+    for(int i = 0; i < count; i++, cell += img->x_step, cached += channels) {
+        memcpy(cached, cell, channels);
+    }
+}
+
+// Renders img into cache->art as render_rows would, keeping the glyphs of every block of
+// cells still within --frame-tolerance of the pixels they were drawn from. Dithering,
+// edges and tone mapping make each glyph depend on other cells, so with those the frame is
+// only kept when no block changed, and drawn in full otherwise.
+void render_coherent(const image_view *img, const config *conf, frame_cache *cache) {
+    const double start = now_ms();
+    const size_t pitch = (size_t)img->width + 1;
+    const bool local = conf->dither == DITHER_NONE && !conf->edges && conf->tone == TONE_NONE;
+    const brightness_fn kernel = brightness_kernel(img);
+    double brightness[KERNEL_BLOCK];
+    int char_index[KERNEL_BLOCK];
+    const uint64_t blocks = (uint64_t)img->height * ((img->width + KERNEL_BLOCK - 1) / KERNEL_BLOCK);
+    uint64_t reused = 0;
+    for(int y = 0; y < img->height && !cache->filled; y++) {
+        cache->art[y * pitch + img->width] = '\n';
+    }
+    // Without local glyphs the first changed block settles it, so the scan stops there
+    bool changed = !cache->filled;
+    for(int y = 0; y < img->height && (local || !changed); y++) {
+        for(int x = 0; x < img->width && (local || !changed); x += KERNEL_BLOCK) {
+            const int count = img->width - x < KERNEL_BLOCK ? img->width - x : KERNEL_BLOCK;
+            unsigned char *cached = cache->pixels + ((size_t)y * img->width + x) * img->channel_count;
+            if(cache->filled && !cells_changed(img, cached, x, y, count, conf->frame_tolerance)) {
+                reused++;
+                continue;
+            }
+            changed = true;
+            if(local) {
+                keep_cells(img, cached, x, y, count);
+                kernel(img, x, y, count, brightness);
+                kernels->quantize(brightness, 0.0, cache->characters.scale, char_index);
+                map_ramp(&cache->characters, brightness, char_index, count, cache->art + y * pitch + x);
+            }
+        }
+    }
+    if(!local && changed) {
+        reused = 0;
+        for(int y = 0; y < img->height; y++) {
+            keep_cells(img, cache->pixels + (size_t)y * img->width * img->channel_count, 0, y, img->width);
+        }
+        render_rows(img, conf, cache->art);
+    }
+    const double elapsed = now_ms() - start;
+    cache->frames++;
+    cache->blocks += blocks;
+    cache->reused += reused;
+    cache->unchanged += reused == blocks && cache->filled;
+    cache->ms += elapsed;
+    if(reused == 0) {
+        cache->full_ms += elapsed;
+        cache->full_blocks += blocks;
+    }
+    cache->filled = true;
+}
+
+typedef struct stream_frame {
+    unsigned char *pixels;
+    char *art;
+    uint64_t sequence;
+    double arrival;
+    bool stale;
+} stream_frame;
+
+typedef struct frame_stream {
+    const config *conf;
+    config frame_conf;
+    size_t frame_size;
+    int grid_width;
+    int grid_height;
+    size_t art_size;
+    stream_frame *frames;
+    int frame_count;
+    int renderers;
+    frame_cache *caches;
+    // Free slots go to the reader, read frames to the workers and rendered ones to the writer
+    slot_ring free_slots;
+    slot_ring work;
+    slot_ring done;
+    // Frames the reader handed on, published when it reaches the end of stdin
+    uint64_t total;
+    bool terminal;
+    // Set by the writer when stdout fails, and by the reader when stdin does
+    int status;
+    bool read_failed;
+    uint64_t read;
+    uint64_t skipped;
+    uint64_t stale;
+    uint64_t late;
+    uint64_t written;
+    double latency_total;
+    double latency_max;
+} frame_stream;
+
+// Reads whole frames into a spare buffer, which is swapped into a free slot once the frame
+// is in, so whether a frame is kept is decided when it arrives rather than before.
+void stream_read(frame_stream *s) {
+    unsigned char *spare = malloc(s->frame_size);
+    if(!spare) {
+        fputs("Failed to allocate memory for stream frames\n", stderr);
+        exit(1);
+    }
+    uint64_t sequence = 0;
+    size_t got;
+    while((got = fread(spare, 1, s->frame_size, stdin)) == s->frame_size) {
+        const double arrival = now_ms();
+        s->read++;
+        uint32_t slot;
+        if(s->conf->max_latency > 0.0) {
+            if(!ring_pop(&s->free_slots, &slot)) {
+                s->skipped++;
+                continue;
+            }
+        }
+        else {
+            slot = ring_wait_pop(&s->free_slots);
+        }
+        stream_frame *frame = &s->frames[slot];
+        unsigned char *pixels = frame->pixels;
+        frame->pixels = spare;
+        spare = pixels;
+        frame->sequence = sequence++;
+        frame->arrival = arrival;
+        ring_wait_push(&s->work, slot);
+    }
+    if(ferror(stdin)) {
+        fputs("Error reading stream frames from stdin\n", stderr);
+        s->read_failed = true;
+    }
+    else if(got > 0) {
+        fprintf(stderr, "Stream ended partway through a frame. Its %zu of %zu bytes were not rendered.\n", got, s->frame_size);
+    }
+    free(spare);
+    __atomic_store_n(&s->total, sequence, __ATOMIC_RELEASE);
+    for(int i = 0; i < s->renderers; i++) {
+        ring_wait_push(&s->work, STREAM_STOP);
+    }
+}
+
+void stream_render(frame_stream *s, frame_cache *cache) {
+    const config *conf = &s->frame_conf;
+    const bool resize = s->grid_width != conf->stream_width || s->grid_height != conf->stream_height;
+    image_data resized = {NULL, s->grid_height, s->grid_width, conf->stream_channels, 0};
+    if(resize) {
+        resized.data = malloc((size_t)s->grid_width * s->grid_height * conf->stream_channels);
+        if(!resized.data) {
+            fputs("Failed to allocate memory for resized image\n", stderr);
+            exit(1);
+        }
+    }
+    if(conf->cache_frames) {
+        cache->pixels = malloc((size_t)s->grid_width * s->grid_height * conf->stream_channels);
+        cache->art = malloc(s->art_size);
+        if(!cache->pixels || !cache->art) {
+            fputs("Failed to allocate memory for the frame cache\n", stderr);
+            exit(1);
+        }
+        // Touched now so the first frame, which the time saved is measured against, doesn't fault them in
+        memset(cache->pixels, 0, (size_t)s->grid_width * s->grid_height * conf->stream_channels);
+        memset(cache->art, 0, s->art_size);
+        ramp_init(&cache->characters, conf->character_set, conf->invert);
+    }
+    // The buffers above last the whole stream. What a single frame needs, such as resize
+    // scratch and dithering grids, comes from an arena rewound for every frame
+    arena frames;
+    arena_open(&frames, conf->huge_pages);
+    for(;;) {
+        const uint32_t slot = ring_wait_pop(&s->work);
+        if(slot == STREAM_STOP) {
+            break;
+        }
+        stream_frame *frame = &s->frames[slot];
+        frame->stale = conf->max_latency > 0.0 && now_ms() - frame->arrival > conf->max_latency;
+        if(!frame->stale) {
+            arena_begin(&frames, arena_hint(conf->stream_width, conf->stream_height, conf->stream_channels));
+            image_data img = {frame->pixels, conf->stream_height, conf->stream_width, conf->stream_channels, 0};
+            if(resize) {
+                resize_pixels(&img, &resized);
+            }
+            const image_view view = orient_view(resize ? &resized : &img, conf->orientation);
+            if(conf->cache_frames) {
+                render_coherent(&view, conf, cache);
+                memcpy(frame->art, cache->art, s->art_size);
+            }
+            else {
+                render_rows(&view, conf, frame->art);
+            }
+            arena_end(&frames);
+        }
+        ring_wait_push(&s->done, slot);
+    }
+    arena_close(&frames);
+    free(resized.data);
+    if(conf->cache_frames) {
+        free(cache->pixels);
+        free(cache->art);
+        ramp_free(&cache->characters);
+    }
+}
+
+void stream_emit(frame_stream *s, const stream_frame *frame) {
+    if(frame->stale) {
+        s->stale++;
+        return;
+    }
+    if(s->status == 0) {
+        if(s->terminal) {
+            fputs("\033[H", stdout);
+        }
+        if(fwrite(frame->art, 1, s->art_size, stdout) != s->art_size || putchar('\n') == EOF || fflush(stdout) != 0) {
+            s->status = 1;
+        }
+    }
+    const double latency = now_ms() - frame->arrival;
+    s->written++;
+    s->latency_total += latency;
+    s->latency_max = latency > s->latency_max ? latency : s->latency_max;
+    if(s->conf->max_latency > 0.0 && latency > s->conf->max_latency) {
+        s->late++;
+    }
+}
+
+// Workers finish frames out of order. Each is parked by sequence until the ones before it
+// are written, which takes at most one place per slot.
+void stream_write(frame_stream *s) {
+    uint32_t *parked = malloc(sizeof(uint32_t) * s->frame_count);
+    if(!parked) {
+        fputs("Failed to allocate memory for stream frames\n", stderr);
+        exit(1);
+    }
+    for(int i = 0; i < s->frame_count; i++) {
+        parked[i] = STREAM_STOP;
+    }
+    uint64_t next = 0;
+    int waits = 0;
+    while(next < __atomic_load_n(&s->total, __ATOMIC_ACQUIRE)) {
+        uint32_t slot;
+        if(!ring_pop(&s->done, &slot)) {
+            ring_backoff(&waits);
+            continue;
+        }
+        waits = 0;
+        parked[s->frames[slot].sequence % s->frame_count] = slot;
+        while(parked[next % s->frame_count] != STREAM_STOP) {
+            slot = parked[next % s->frame_count];
+            parked[next % s->frame_count] = STREAM_STOP;
+            stream_emit(s, &s->frames[slot]);
+            ring_wait_push(&s->free_slots, slot);
+            next++;
+        }
+    }
+    free(parked);
+}
+
+void stream_worker(void *ctx, int worker, int worker_count) {
+    (void)worker_count;
+    frame_stream *s = ctx;
+    if(worker == 0) {
+        stream_read(s);
+    }
+    else if(worker == 1) {
+        stream_write(s);
+    }
+    else {
+        stream_render(s, &s->caches[worker - 2]);
+    }
+}
+
+// The share of cell blocks kept from earlier frames, and the time that saved, estimated
+// from how long frames drawn in full took per block.
+void report_caches(const frame_cache *caches, const int count) {
+    frame_cache total;
+    memset(&total, 0, sizeof(total));
+    for(int i = 0; i < count; i++) {
+        total.frames += caches[i].frames;
+        total.blocks += caches[i].blocks;
+        total.reused += caches[i].reused;
+        total.unchanged += caches[i].unchanged;
+        total.ms += caches[i].ms;
+        total.full_ms += caches[i].full_ms;
+        total.full_blocks += caches[i].full_blocks;
+    }
+    const double full_estimate = total.full_blocks ? total.full_ms * total.blocks / total.full_blocks : total.ms;
+    fprintf(stderr, "cache:  %9.3f ms  %.1f%% of cell blocks kept, %llu of %llu frames unchanged, about %.3f ms saved\n",
+            total.ms, total.blocks ? 100.0 * total.reused / total.blocks : 0.0, (unsigned long long)total.unchanged,
+            (unsigned long long)total.frames, full_estimate - total.ms);
+}
+
+int render_stream(const config *conf) {
+    const double start = now_ms();
+    frame_stream s;
+    memset(&s, 0, sizeof(s));
+    s.conf = conf;
+    s.frame_conf = *conf;
+    s.frame_conf.threads = 1;
+    s.frame_size = (size_t)conf->stream_width * conf->stream_height * conf->stream_channels;
+    variant_grids(conf, conf->stream_width, conf->stream_height, &s.grid_width, &s.grid_height);
+    const image_data grid = {NULL, s.grid_height, s.grid_width, conf->stream_channels, 0};
+    const image_view view = orient_view(&grid, conf->orientation);
+    s.art_size = rendered_size(&view);
+    // Frames are spread over the workers' caches, which only give the same output at any
+    // thread count while they keep identical cells alone
+    s.renderers = conf->cache_frames && conf->frame_tolerance > 0 ? 1 : conf->threads;
+    // A frame being rendered and one queued for each worker, with one more being written
+    s.frame_count = s.renderers * 2 + 1;
+    s.frames = calloc(s.frame_count, sizeof(stream_frame));
+    s.caches = calloc(s.renderers, sizeof(frame_cache));
+    if(!s.frames || !s.caches) {
+        fputs("Failed to allocate memory for stream frames\n", stderr);
+        exit(1);
+    }
+    ring_open(&s.free_slots, s.frame_count);
+    ring_open(&s.work, s.frame_count + s.renderers);
+    ring_open(&s.done, s.frame_count);
+    for(int i = 0; i < s.frame_count; i++) {
+        s.frames[i].pixels = malloc(s.frame_size);
+        s.frames[i].art = malloc(s.art_size);
+        if(!s.frames[i].pixels || !s.frames[i].art) {
+            fputs("Failed to allocate memory for stream frames\n", stderr);
+            exit(1);
+        }
+        ring_push(&s.free_slots, (uint32_t)i);
+    }
+    s.total = UINT64_MAX;
+    s.terminal = isatty(STDOUT_FILENO);
+    if(s.terminal) {
+        fputs("\033[2J", stdout);
+    }
+    run_workers(s.renderers + 2, stream_worker, &s);
+
+    if(conf->stats) {
+        const uint64_t dropped = s.skipped + s.stale;
+        fprintf(stderr, "stream: %9.3f ms  %llu frames read, %llu written, %llu dropped (%llu with no free slot, %llu stale), "
+                "%llu late, %d render threads\n", now_ms() - start, (unsigned long long)s.read, (unsigned long long)s.written,
+                (unsigned long long)dropped, (unsigned long long)s.skipped, (unsigned long long)s.stale,
+                (unsigned long long)s.late, s.renderers);
+        fprintf(stderr, "delay:  %9.3f ms  average from read to written, %.3f ms at most\n",
+                s.written ? s.latency_total / s.written : 0.0, s.latency_max);
+        if(conf->cache_frames) {
+            report_caches(s.caches, s.renderers);
+        }
+    }
+    for(int i = 0; i < s.frame_count; i++) {
+        free(s.frames[i].pixels);
+        free(s.frames[i].art);
+    }
+    free(s.frames);
+    free(s.caches);
+    free(s.free_slots.cells);
+    free(s.work.cells);
+    free(s.done.cells);
+    return s.read_failed ? 1 : s.status;
+}
+#else
+int render_stream(const config *conf) {
+    (void)conf;
+    fputs("--stream needs a build with threads.\n", stderr);
+    return 1;
+}
+#endif
+
+// Identifies the options that change what a run writes. Options that only change how fast
+// it gets there, like --threads and --prefetch, are left out.
+uint64_t params_hash(const config *conf) {
+    int columns, rows;
+    grid_bounds(conf, &columns, &rows);
+    const int options[] = {
+        conf->invert, conf->variant_count, conf->dither, conf->fit, columns, rows, conf->format,
+        conf->crop.x, conf->crop.y, conf->crop.width, conf->crop.height,
+        conf->orientation, conf->exif_orientation, conf->prefer_thumbnail, conf->edges, conf->tone, conf->from_lum
+    };
+    uint64_t hash = fnv1a(options, sizeof(options), FNV_OFFSET);
+    for(int i = 0; i < conf->style_count; i++) {
+        hash = fnv1a(conf->style_sets[i], strlen(conf->style_sets[i]) + 1, hash);
+        hash = fnv1a(&conf->style_inverts[i], sizeof(bool), hash);
+    }
+    hash = fnv1a(conf->w_scales, sizeof(double) * conf->variant_count, hash);
+    hash = fnv1a(conf->h_scales, sizeof(double) * conf->variant_count, hash);
+    if(conf->output_path) {
+        hash = fnv1a(conf->output_path, strlen(conf->output_path) + 1, hash);
+    }
+    if(conf->save_lum_path) {
+        hash = fnv1a(conf->save_lum_path, strlen(conf->save_lum_path) + 1, hash);
+    }
+    return hash;
+}
+
+// The renders a manifest file records as done with this run's options, as a set of input
+// hashes, and the file that records of new renders are appended to.
+typedef struct manifest {
+    uint64_t *done;
+    size_t capacity;
+    uint64_t params;
+    FILE *file;
+} manifest;
+
+void manifest_add(manifest *m, const uint64_t input) {
+    // 0 marks an empty slot
+    const uint64_t key = input ? input : 1;
+    size_t slot = (size_t)(key * 0x9e3779b97f4a7c15ULL) & (m->capacity - 1);
+    while(m->done[slot] != 0 && m->done[slot] != key) {
+        slot = (slot + 1) & (m->capacity - 1);
+    }
+    m->done[slot] = key;
+}
+
+bool manifest_done(const manifest *m, const uint64_t input) {
+    if(m->capacity == 0) {
+        return false;
+    }
+    const uint64_t key = input ? input : 1;
+    size_t slot = (size_t)(key * 0x9e3779b97f4a7c15ULL) & (m->capacity - 1);
+    while(m->done[slot] != 0) {
+        if(m->done[slot] == key) {
+            return true;
+        }
+        slot = (slot + 1) & (m->capacity - 1);
+    }
+    return false;
+}
+
+// Reads the records already in path, if it exists, and opens it for appending.
+void manifest_open(manifest *m, const char *path, const uint64_t params) {
+    memset(m, 0, sizeof(*m));
+    m->params = params;
+    size_t size;
+    char *data = (char*)read_file(path, &size);
+    if(data) {
+        size_t lines = 0;
+        for(size_t i = 0; i < size; i++) {
+            lines += data[i] == '\n';
+        }
+        m->capacity = 16;
+        while(m->capacity < lines * 2) {
+            m->capacity *= 2;
+        }
+        m->done = calloc(m->capacity, sizeof(uint64_t));
+        if(!m->done) {
+            fputs("Error allocating memory for manifest...\n", stderr);
+            exit(1);
+        }
+        char *line = data;
+        for(size_t i = 0; i < size; i++) {
+            if(data[i] != '\n') {
+                continue;
+            }
+            // A line cut short by a run that died mid-write has no newline and is ignored
+            data[i] = '\0';
+            unsigned long long input, params;
+            if(sscanf(line, "input=%llx params=%llx", &input, &params) == 2 && params == m->params) {
+                manifest_add(m, input);
+            }
+            line = data + i + 1;
+        }
+        free(data);
+    }
+    m->file = fopen(path, "ab");
+    if(!m->file) {
+        fprintf(stderr, "Error opening manifest %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+    setvbuf(m->file, NULL, _IONBF, 0);
+}
+
+// Appends the record of a finished render. Each record is one unbuffered write to a file
+// opened for appending, so processes sharing a manifest never interleave their records.
+void manifest_record(manifest *m, const char *path, const size_t output_bytes, const double ms) {
+    const size_t size = strlen(path) + 128;
+    char *record = malloc(size);
+    if(!record) {
+        return;
+    }
+    const int length = snprintf(record, size, "input=%016llx params=%016llx output_bytes=%zu ms=%.3f file=%s\n",
+                                (unsigned long long)input_hash(path), (unsigned long long)m->params, output_bytes, ms, path);
+    if(length > 0 && fwrite(record, 1, (size_t)length, m->file) != (size_t)length) {
+        fprintf(stderr, "Error writing manifest record for %s\n", path);
+    }
+    free(record);
+}
+
+void manifest_close(manifest *m) {
+    if(m->file) {
+        fclose(m->file);
+    }
+    free(m->done);
+}
+
+// Keeps only the inputs in this run's shard and, when skip_done is set, not already in
+// the manifest, preserving their order. Paths are hashed so a shard gets the same files
+// however the inputs are listed.
+void select_inputs(config *conf, const manifest *m, const bool skip_done) {
+    int kept = 0;
+    int skipped = 0;
+    for(int i = 0; i < conf->file_count; i++) {
+        char *path = conf->filenames[i];
+        const bool in_shard = fnv1a(path, strlen(path), FNV_OFFSET) % (uint64_t)conf->shard_count == (uint64_t)conf->shard;
+        const bool done = in_shard && skip_done && manifest_done(m, input_hash(path));
+        if(in_shard && !done) {
+            conf->filenames[kept++] = path;
+        }
+        else {
+            skipped += done;
+            free(path);
+        }
+    }
+    conf->file_count = kept;
+    if(conf->stats && skipped > 0) {
+        fprintf(stderr, "manifest: skipping %d images already rendered\n", skipped);
+    }
+}
+
+int main(int argc, char **argv) {
+    if(argc < 2) {
+        print_help();
+        return 0;
+    }
+
+    config conf;
+    set_config(&conf, argc, argv);
+    select_kernels(conf.cpu_level);
+    if(conf.stats) {
+        fprintf(stderr, "cpu:    %s kernels, %s resize\n", cpu_level_names[conf.cpu_level], kernels->resize_name);
+    }
+    manifest done = {NULL, 0, 0, NULL};
+    if(conf.manifest_path && !conf.plan) {
+        manifest_open(&done, conf.manifest_path, params_hash(&conf));
+    }
+    select_inputs(&conf, &done, !conf.plan);
+
+    prefetcher prefetch;
+    const bool montage = conf.montage_columns > 0 && !conf.plan && conf.file_count > 0;
+    const bool stream = conf.stream_width > 0;
+    arena render;
+    arena_open(&render, conf.huge_pages);
+    prefetch_start(&prefetch, conf.filenames, conf.file_count, conf.plan || montage || conf.file_count < 2 ? 0 : conf.prefetch);
+    int status = stream ? render_stream(&conf) : montage ? render_montage(&conf) : 0;
+    for(int i = 0; i < conf.file_count && !montage; i++) {
+        if(conf.plan) {
+            arena_begin(&render, 0);
+            status |= plan_file(&conf, conf.filenames[i]);
+            arena_end(&render);
+            continue;
+        }
+        const double wait_start = now_ms();
+        const input_file *in = prefetch_take(&prefetch, i);
+        if(conf.stats && in->data) {
+            fprintf(stderr, "input:  %9.3f ms  %zu bytes, read ahead by %s\n", now_ms() - wait_start, in->size, prefetch.method);
+        }
+        const double render_start = now_ms();
+        size_t written = 0;
+        arena_begin(&render, render_hint(in));
+        const int file_status = conf.from_lum ? render_lum(&conf, in, &written) : render_file(&conf, in, &written);
+        arena_end(&render);
+        if(conf.stats) {
+            arena_report(&render);
+        }
+        if(file_status == 0 && done.file) {
+            manifest_record(&done, in->name, written, now_ms() - render_start);
+        }
+        status |= file_status;
+        prefetch_release(&prefetch, i);
+    }
+    prefetch_stop(&prefetch);
+    arena_close(&render);
+    manifest_close(&done);
+    for(int i = 0; i < conf.file_count; i++) {
+        free(conf.filenames[i]);
+    }
+    free(conf.filenames);
+    for(int i = 0; i < conf.character_set_count; i++) {
+        free(conf.character_sets[i]);
+    }
+    free(conf.output_path);
+    free(conf.manifest_path);
+    free(conf.save_lum_path);
+    return status;
 }
@@ -0,0 +1,30 @@
+/*
+* asciigen - CLI Ascii Art generator from image files
+* Copyright (c) 2025 Patrick Seute
+*/
+
+// A second copy of stb_image_resize2 built with its AVX2 paths, compiled with -mavx2 so
+// main.c can pick it at startup on CPUs that have it. Everything in it is static apart
+// from the entry point below. FMA stays off so it matches the SSE2 copy bit for bit.
+
+#include <stddef.h>
+
+// Temporary memory comes from main.c's per-render arena, as for the SSE2 copy
+void* arena_malloc(const size_t size);
+void arena_free(void *p);
+#define STBIR_MALLOC(size, user_data) ((void)(user_data), arena_malloc(size))
+#define STBIR_FREE(ptr, user_data) ((void)(user_data), arena_free(ptr))
+
+#define STBIRDEF static
+#define STB_IMAGE_RESIZE_IMPLEMENTATION
+#define STBIR_AVX2
+#if defined(__GNUC__)
+#pragma GCC diagnostic ignored "-Wunused-function"
+#endif
+#include "stb_image_resize2.h"
+
+int resize_extended_avx2(STBIR_RESIZE *resize);
+
+int resize_extended_avx2(STBIR_RESIZE *resize) {
+    return stbir_resize_extended(resize);
+}
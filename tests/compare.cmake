@@ -0,0 +1,11 @@
+# Runs asciigen on IMAGE with ARGS and fails unless its output matches EXPECTED byte for byte.
+# Usage: cmake -DASCIIGEN=path -DARGS="-s 0.25" -DIMAGE=file -DEXPECTED=file -DOUTPUT=file -P compare.cmake
+separate_arguments(args UNIX_COMMAND "${ARGS}")
+execute_process(COMMAND "${ASCIIGEN}" ${args} "${IMAGE}" OUTPUT_FILE "${OUTPUT}" RESULT_VARIABLE result)
+if(NOT result EQUAL 0)
+    message(FATAL_ERROR "asciigen ${ARGS} ${IMAGE} exited with ${result}")
+endif()
+execute_process(COMMAND "${CMAKE_COMMAND}" -E compare_files "${OUTPUT}" "${EXPECTED}" RESULT_VARIABLE differ)
+if(differ)
+    message(FATAL_ERROR "${OUTPUT} differs from ${EXPECTED}")
+endif()